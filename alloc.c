@@ -3,16 +3,40 @@
 #include <stdio.h>
 #include <string.h>
 #include "dk.h"
-#define POOLSZ  4096
-#define APOOLSZ 1024
+#define BLKSZ   32768
+#define APOOLSZ 16384
+#define STKSZ   64
+#define TARSZ   4096
+#define TARKEEP 65536
 
-/* One memory pool is kept to store values of allocated
- * pointers, during one translation phase memory is never
- * freed, at the end of the translation, the whole pool is
- * released.
+/* One memory pool is used to store terms, patterns and other
+ * short lived objects, during one translation phase memory is
+ * never freed, at the end of the translation, the whole pool
+ * is released.
+ * Objects are allocated contiguously in large blocks by bumping
+ * a pointer, this avoids the per object overhead of malloc and
+ * keeps related objects close in memory. The tot field is
+ * the number of bytes used in the pool.
+ * Each thread has its own current pool, when code generation
+ * runs in a separate thread, the pool of a declaration is
+ * detached by the parser and adopted by the generator.
+ * Terms are not stored in blocks but in the arena t of the
+ * pool, so they move with it; tcur always points to the arena
+ * of the current pool.
  */
-static void **pool;
-static size_t pi, psz;
+struct Pool {
+	struct Blk {
+		struct Blk *n;
+		size_t i, sz;
+		char p[];
+	} *b;
+	size_t tot;
+	struct Terms t;
+};
+
+static __thread struct Pool *pool;
+__thread struct Terms *tcur;
+struct Terms tperm;
 
 /* Fast string management with sharing is achieved using a
  * hash table to store all strings (atoms) used during the
@@ -20,15 +44,30 @@ static size_t pi, psz;
  * module name (including the trailing '.'), it is 0 if the
  * name is not qualified. For instance, the qual field of
  * the atom "Mod.A.x" is 6.
+ * The mang field caches the Lua names of the atom computed
+ * by amangle, mlen is their length. The qa field caches the
+ * atom qualified by the module numbered qm.
  * The s field must remain the first, it allows to recover
  * the pointer to the struct Atom by a simple cast.
+ * The table has a fixed number of buckets, APOOLSZ, it is
+ * never resized so lookups need no synchronization beyond
+ * the load of the bucket head. This limits the number of
+ * atoms it handles well: chains grow linearly past a few
+ * atoms per bucket, with 262144 atoms 'make atoms' interns
+ * about four times slower than with 65536. Raise APOOLSZ if
+ * inputs get larger.
  */
 struct Atom {
 	char s[IDLEN];
 	unsigned char qual;
+	unsigned short mlen;
+	char *mang;
+	unsigned qm;
+	char *qa;
 	struct Atom *next;
 } **apool;
 
+
 /* ------------- Long lived memory management. ------------- */
 
 /* xalloc - A safe memory allocator, will exit if we run
@@ -41,7 +80,7 @@ xalloc(size_t s)
 	if (!p) {
 		fprintf(stderr, "We are out of memory.\n"
 		                "\tSize of the current pool: %zuk\n"
-		              , pi/1024);
+		              , pool?pool->tot/1024:0);
 		abort();
 	}
 	return p;
@@ -56,7 +95,7 @@ xrealloc(void *p, size_t s)
 	if (!p) {
 		fprintf(stderr, "We are out of memory.\n"
 		                "\tSize of the current pool: %zuk\n"
-		              , pi/1024);
+		              , pool?pool->tot/1024:0);
 		abort();
 	}
 	return p;
@@ -70,8 +109,8 @@ initalloc(void)
 {
 	int i;
 
-	psz=POOLSZ;
-	pool=xalloc(psz*sizeof *pool);
+	pool=pnew();
+	tcur=&pool->t;
 	apool=xalloc(APOOLSZ*sizeof *apool);
 	for (i=0; i<APOOLSZ; i++)
 		apool[i]=0;
@@ -85,11 +124,12 @@ deinitalloc(void)
 {
 	int i;
 
-	free(pool);
+	padopt(0);
 	for (i=0; i<APOOLSZ; i++) {
 		struct Atom *t, *p=apool[i];
 		while (p) {
 			t=p->next;
+			free(p->mang);
 			free(p);
 			p=t;
 		}
@@ -113,22 +153,42 @@ hash(const char *s)
 /* astrdup - Return an atom string allocated on the heap equal to
  * the string passed as argument. The qual argument is the length
  * of the module part of the input string.
+ * Atoms can be created concurrently by several threads, lookups
+ * do not lock and new atoms are inserted at the head of their
+ * bucket with a compare and swap. The s, qual and next fields
+ * are never modified once an atom is published. The caches are
+ * filled later: mang and mlen are set once by amangle, mang is
+ * published with a compare and swap; qm and qa are written by
+ * aqset, see there.
  */
 char *
 astrdup(const char *s, int qual)
 {
-	struct Atom **p;
+	struct Atom **b, *h, *a, *n;
 
 	assert(strlen(s)<IDLEN);
-	p=&apool[hash(s)%APOOLSZ];
-	while (*p && strcmp((*p)->s, s)!=0)
-		p=&(*p)->next;
-	if (*p)
-		return (*p)->s;
-	*p=xalloc(sizeof **p);
-	(*p)->qual=qual;
-	(*p)->next=0;
-	return strcpy((*p)->s, s);
+	b=&apool[hash(s)%APOOLSZ];
+	h=__atomic_load_n(b, __ATOMIC_ACQUIRE);
+	for (a=h; a; a=a->next)
+		if (strcmp(a->s, s)==0)
+			return a->s;
+	n=xalloc(sizeof *n);
+	n->qual=qual;
+	n->mang=0;
+	n->qm=0;
+	n->qa=0;
+	strcpy(n->s, s);
+	for (;;) {
+		n->next=h;
+		if (__atomic_compare_exchange_n(b, &h, n, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+			return n->s;
+		/* Check the atoms inserted since the lookup. */
+		for (a=h; a!=n->next; a=a->next)
+			if (strcmp(a->s, s)==0) {
+				free(n);
+				return a->s;
+			}
+	}
 }
 
 /* aqual - Return the length of the module part of an atom.
@@ -141,21 +201,155 @@ aqual(const char *s)
 	return a->qual;
 }
 
+/* aqget - Return the atom s qualified by the module numbered
+ * m, as recorded by aqset, 0 is returned if it was not
+ * recorded. Module numbers are not 0.
+ * The qm and qa fields are not synchronized, aqget and aqset
+ * are only used by mqual which runs on the thread processing
+ * items (parsing threads only record them, the generator does
+ * not qualify names).
+ */
+char *
+aqget(const char *s, unsigned m)
+{
+	struct Atom *a=(struct Atom *)s;
+	return a->qm==m?a->qa:0;
+}
+
+/* aqset - Record q as the atom s qualified by the module
+ * numbered m, this replaces the previous record.
+ */
+void
+aqset(const char *s, unsigned m, char *q)
+{
+	struct Atom *a=(struct Atom *)s;
+	a->qm=m;
+	a->qa=q;
+}
+
+/* amangle - Return the Lua names of an atom, they are computed
+ * on first use and cached in the atom. The module part is kept
+ * as is, in the identifier, 'x' is escaped as "xx" and '\'' as
+ * "xq". The code name, suffixed by "_c", is returned and the
+ * term name, suffixed by "_t", follows it after its nul byte.
+ * The length of both names is stored in *n.
+ */
+char *
+amangle(const char *s, int *n)
+{
+	struct Atom *a=(struct Atom *)s;
+	char *m, *p, *e;
+	int l;
+
+	if ((m=__atomic_load_n(&a->mang, __ATOMIC_ACQUIRE))) {
+		*n=__atomic_load_n(&a->mlen, __ATOMIC_RELAXED);
+		return m;
+	}
+	for (l=a->qual+2, p=a->s+a->qual; *p; p++)
+		l+=1+(*p=='x' || *p=='\'');
+	m=p=xalloc(2*l+2);
+	memcpy(p, a->s, a->qual);
+	for (p+=a->qual, s+=a->qual; *s; s++) {
+		if (*s=='x' || *s=='\'') {
+			*p++='x';
+			*p++=*s=='\''?'q':'x';
+			continue;
+		}
+		*p++=*s;
+	}
+	memcpy(p, "_c", 3);
+	memcpy(p+3, m, l-1);
+	m[2*l]='t';
+	m[2*l+1]=0;
+	__atomic_store_n(&a->mlen, l, __ATOMIC_RELAXED); /* Same value for all threads. */
+	e=0;
+	if (!__atomic_compare_exchange_n(&a->mang, &e, m, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+		free(m);
+		m=e;
+	}
+	*n=l;
+	return m;
+}
+
 /* ------------- Short lived memory management. ------------- */
 
-/* dkalloc - Allocate one memory block in the pool.
+/* pnew - Create an empty memory pool, no block is allocated
+ * until the first allocation.
+ */
+struct Pool *
+pnew(void)
+{
+	struct Pool *p=xalloc(sizeof *p);
+
+	p->b=0;
+	p->tot=0;
+	p->t=(struct Terms){ 0 };
+	return p;
+}
+
+/* palloc - Allocate an object of size s in a pool, objects
+ * are aligned on 8 bytes.
  */
 void *
-dkalloc(size_t s)
+palloc(struct Pool *p, size_t s)
 {
-	if (pi>=psz) {
-		psz*=2;
-		fprintf(stderr, "Pool too small, allocating %zu entries.\n"
-		              , psz);
-		pool=xrealloc(pool, psz*sizeof *pool);
+	struct Blk *b=p->b;
+	size_t sz;
+
+	s=(s+7)&~(size_t)7;
+	if (!b || b->i+s>b->sz) {
+		sz=s>BLKSZ?s:BLKSZ;
+		b=xalloc(sizeof *b+sz);
+		b->n=p->b;
+		b->i=0;
+		b->sz=sz;
+		p->b=b;
 	}
-	pool[pi] = xalloc(s);
-	return pool[pi++];
+	b->i+=s;
+	p->tot+=s;
+	return b->p+b->i-s;
+}
+
+/* preset - Release all the objects of a pool, the last block
+ * allocated is kept for later allocations.
+ */
+void
+preset(struct Pool *p)
+{
+	struct Blk *b, *n;
+
+	p->tot=0;
+	if (p->t.sz>TARKEEP)
+		tfree(&p->t);
+	else if (p->t.n)
+		p->t.n=1;
+	if (!p->b)
+		return;
+	for (b=p->b->n; b; b=n) {
+		n=b->n;
+		free(b);
+	}
+	p->b->n=0;
+	p->b->i=0;
+}
+
+/* pfree - Free a pool and all its blocks.
+ */
+void
+pfree(struct Pool *p)
+{
+	preset(p);
+	tfree(&p->t);
+	free(p->b);
+	free(p);
+}
+
+/* dkalloc - Allocate one memory block in the current pool.
+ */
+void *
+dkalloc(size_t s)
+{
+	return palloc(pool, s);
 }
 
 /* dkfree - Free the temporary memory pool.
@@ -163,7 +357,81 @@ dkalloc(size_t s)
 void
 dkfree(void)
 {
-	while (pi--)
-		free(pool[pi]);
-	pi=0;
+	preset(pool);
+}
+
+/* pdetach - Detach the current pool of the calling thread and
+ * return it, a new empty pool becomes the current one.
+ */
+struct Pool *
+pdetach(void)
+{
+	struct Pool *p=pool;
+
+	pool=pnew();
+	tcur=&pool->t;
+	return p;
+}
+
+/* padopt - Free the current pool of the calling thread and make
+ * p its current pool, p can be null if the thread will not
+ * allocate from its pool anymore.
+ */
+void
+padopt(struct Pool *p)
+{
+	if (pool)
+		pfree(pool);
+	pool=p;
+	tcur=p?&p->t:0;
+}
+
+/* ------------- Term arenas. ------------- */
+
+/* tnew - Allocate a node of kind k in the arena a and return
+ * its index, its other fields are undefined. The arena is
+ * resized if it is full, this moves its nodes.
+ */
+Term
+tnew(struct Terms *a, int k)
+{
+	if (a->n==0)
+		a->n=1; /* Index 0 is no term. */
+	if (a->n>=a->sz) {
+		if (a->sz>=TPERM/2) {
+			fprintf(stderr, "%s: Too many term nodes.\n", __func__);
+			exit(1); // FIXME
+		}
+		a->sz=a->sz?2*a->sz:TARSZ;
+		a->k=xrealloc(a->k, a->sz*sizeof *a->k);
+		a->x=xrealloc(a->x, a->sz*sizeof *a->x);
+		a->l=xrealloc(a->l, a->sz*sizeof *a->l);
+		a->r=xrealloc(a->r, a->sz*sizeof *a->r);
+	}
+	a->k[a->n]=k;
+	return a->n++;
+}
+
+/* tfree - Free the nodes of an arena, it is left empty.
+ */
+void
+tfree(struct Terms *a)
+{
+	free(a->k);
+	free(a->x);
+	free(a->l);
+	free(a->r);
+	*a=(struct Terms){ 0 };
+}
+
+/* ------------- Growable stacks. ------------- */
+
+/* sgrow - Resize a full stack, the inline part of stack
+ * operations is in dk.h.
+ */
+void
+sgrow(struct Stk *s)
+{
+	s->sz=s->sz?2*s->sz:STKSZ;
+	s->p=xrealloc(s->p, s->sz*s->esz);
 }
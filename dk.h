@@ -1,5 +1,7 @@
+#include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 /* Dk types and functions. */
 
 /* IDLEN - The maximum size of a fully qualified
@@ -7,41 +9,54 @@
  */
 #define IDLEN 128
 
-/* struct Term - Terms of the lambda-Pi calculus are
- * classically represented as a tag and an union. 
+/* Term - Terms of the lambda-Pi calculus are stored in arenas
+ * of nodes in struct-of-arrays form, a term is the 32 bits
+ * index of its root node and 0 is no term. The node i has the
+ * kind k[i] and, depending on it:
+ *
+ *   - App: the function l[i] applied to the argument r[i];
+ *   - Lam: the variable x[i] bound in the body r[i];
+ *   - Pi: the variable x[i] (0 if anonymous) of domain l[i]
+ *     bound in the codomain r[i];
+ *   - Var: the name x[i].
+ *
+ * A node takes 17 bytes. Each memory pool has its arena of
+ * terms, terms are read and built in the arena of the current
+ * pool of the thread, tcur. Indices with the TPERM bit set
+ * designate nodes of the permanent arena tperm, the native
+ * kernel stores the terms of the signature there.
  */
-struct Term {
-	enum { App, Lam, Pi, Var, Type } typ;
-	union {
-		struct {
-			struct Term *t1;
-			struct Term *t2;
-		} app;
-		struct {
-			char *x;
-			struct Term *t;
-		} lam;
-		struct {
-			char *x;
-			struct Term *ty;
-			struct Term *t;
-		} pi;
-		char *var;
-	} u;
+typedef unsigned Term;
+
+enum { App, Lam, Pi, Var, Type };
+
+struct Terms {
+	unsigned char *k;
+	char **x;
+	Term *l, *r;
+	Term n, sz;
 };
 
-#define uapp u.app
-#define ulam u.lam
-#define upi  u.pi
-#define uvar u.var
+#define TPERM 0x80000000u
+
+extern __thread struct Terms *tcur;
+extern struct Terms tperm;
+
+#define tarena(t) ((t)&TPERM ? &tperm : tcur)
+#define tkind(t)  (tarena(t)->k[(t)&~TPERM])
+#define tx(t)     (tarena(t)->x[(t)&~TPERM])
+#define tl(t)     (tarena(t)->l[(t)&~TPERM])
+#define tr(t)     (tarena(t)->r[(t)&~TPERM])
 
 /* struct Pat - Patterns are construcors applied first
  * to a list of nd dot patterns stored in the array ds,
  * then to a list of np patterns stored in the array
  * ps.
- * The loc field is a 0 terminated array of integers
- * representing the location of the current constructor
- * in a bigger pattern.
+ * Paths are not stored, the up field points to the
+ * parent pattern (it is 0 for the head of a rule) and a
+ * is the argument position in the parent, hence the path
+ * of a sub pattern is the path of its parent followed by
+ * a.
  * As a convention, if np is negative, the pattern is a
  * variable (but this cannot be detected during the
  * parsing). The contents of the other fields is then
@@ -49,23 +64,23 @@ struct Term {
  */
 struct Pat {
 	char *c;
-	int nd, np, *loc;
-	struct Term **ds;
-	struct Pat **ps;
+	int nd, np, a;
+	Term *ds;
+	struct Pat **ps, *up;
 };
 
 /* struct VPth - This structure binds a pattern variable
- * to its path in the global rule pattern. A path is a 0
- * terminated array of integers.
+ * to its occurrence in the global rule pattern, the path
+ * of the variable is obtained from the up links of p.
  * For instance, the path of x in:
  *
  *     plus y (S x)
  *
- * is { 2, 1, 0 }.
+ * is { 2, 1 }.
  */
 struct VPth {
 	char *x;
-	int *p;
+	struct Pat *p;
 };
 
 struct Rule {
@@ -73,9 +88,21 @@ struct Rule {
 	int elen;
 	struct Env *e;
 	struct Pat *l;
-	struct Term *r;
+	Term r;
 };
 
+/* struct Stk - Growable stacks, they are used to traverse
+ * terms and patterns without recursing on the C stack. The
+ * elements of a stack are of size esz, the macro STK
+ * initializes a stack for a given element type.
+ */
+struct Stk {
+	char *p;
+	size_t i, sz, esz;
+};
+
+#define STK(ty) { 0, 0, 0, sizeof (ty) }
+
 #define MAXRULES 32
 struct RSet {
 	struct Rule s[MAXRULES];
@@ -90,17 +117,42 @@ void initalloc(void);
 void deinitalloc(void);
 char *astrdup(const char *, int);
 int aqual(const char *);
+char *aqget(const char *, unsigned);
+void aqset(const char *, unsigned, char *);
+char *amangle(const char *, int *);
 void *dkalloc(size_t);
 void dkfree(void);
+struct Pool;
+struct Pool *pnew(void);
+void *palloc(struct Pool *, size_t);
+void preset(struct Pool *);
+void pfree(struct Pool *);
+struct Pool *pdetach(void);
+void padopt(struct Pool *);
+Term tnew(struct Terms *, int);
+void tfree(struct Terms *);
+void sgrow(struct Stk *);
+
+/* spush spop stop - Push a copy of the element pointed by e,
+ * pop the top element in the object pointed by e, and return
+ * a pointer to the top element, valid until the next push.
+ * They run once per term node or emitted job, so they are
+ * macros and only spush calls sgrow on a full stack.
+ */
+#define spush(s, e) ((s)->i<(s)->sz ? (void)0 : sgrow(s), \
+	(void)memcpy((s)->p+(s)->i++*(s)->esz, (e), (s)->esz))
+#define spop(s, e) (assert((s)->i>0), (s)->i--, \
+	(void)memcpy((e), (s)->p+(s)->i*(s)->esz, (s)->esz))
+#define stop(s) (assert((s)->i>0), (void *)((s)->p+((s)->i-1)*(s)->esz))
 
 /* Module term.c */
-extern struct Term *ttype;
-struct Term *mkapp(struct Term *, struct Term *);
-struct Term *mkvar(char *);
-struct Term *mklam(char *, struct Term *);
-struct Term *mkpi(char *, struct Term *, struct Term *);
-int napps(struct Term *, struct Term **);
-int iskind(struct Term *);
+Term mktype(void);
+Term mkapp(Term, Term);
+Term mkvar(char *);
+Term mklam(char *, Term);
+Term mkpi(char *, Term, Term);
+int napps(Term, Term *);
+int iskind(Term);
 
 /* Module pat.c */
 struct PArr;
@@ -115,27 +167,42 @@ enum IdStatus { DECL, DEF };
 void initscope(void);
 void deinitscope(void);
 void pushscope(char *);
-int tscope(struct Term *, struct Env *);
+int tscope(Term, struct Env *);
 int pscope(struct Pat *, struct Env *);
 enum IdStatus chscope(char *, enum IdStatus);
-struct Env *eins(struct Env *, char *, struct Term *);
-struct Term *eget(struct Env *, char *);
-void eiter(struct Env *, void (*)(char *, struct Term *, void *), void *);
+struct Env *eins(struct Env *, char *, Term);
+Term eget(struct Env *, char *);
+void eiter(struct Env *, void (*)(char *, Term, void *), void *);
 size_t elen(struct Env *);
 int escope(struct Env *);
 
 /* Module rule.c */
-int pushrule(struct Env *, struct Pat *, struct Term *);
+int pushrule(struct Env *, struct Pat *, Term);
 void dorules(void);
 
 /* Module gen.c */
-extern enum GenMode { Check, Compile } gmode;
+extern enum GenMode { Check, Compile, Native } gmode;
 extern FILE *gfile;
+extern int gpipe;
+extern int gprof;
+extern int glazy;
+extern int gflush;
+extern FILE *glink;
+int profload(char *);
 void genmod(void);
+void genend(void);
 void genrules(struct RSet *);
-void gendecl(char *, struct Term *);
+void gendecl(char *, Term);
+void genwait(void);
+void genlink(void);
+
+/* Module kern.c */
+void kdecl(char *, Term);
+void krules(struct RSet *);
+void kdeinit(void);
 
 /* Module module.c */
 int mset(char *);
+int mname(char *);
 const char *mget(void);
 char *mqual(char *);
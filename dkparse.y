@@ -1,19 +1,55 @@
 %{
   #include <ctype.h>
+  #include <pthread.h>
+  #include <stdint.h>
   #include <stdlib.h>
   #include <stdio.h>
   #include <string.h>
   #include "dk.h"
 
-  static FILE *f;
-  static int yylex(void);
-  static void yyerror(const char *);
+  /* Deeply nested terms need a deep parser stack, it is
+   * allocated on the heap.
+   */
+  #define YYSTACK_USE_ALLOCA 0
+  #define YYMAXDEPTH 100000000
+
+  /* struct Lex - The state of a lexer, input is read either
+   * from the file f or, if f is null, from the buffer between
+   * p and e. When items is not null, the parser records the
+   * top-level items in this stack instead of processing them.
+   */
+  struct Lex {
+	FILE *f;
+	const char *p, *e;
+	struct Stk *items;
+  };
+
+  /* struct Item - A recorded top-level item, rules of a rule
+   * set are recorded one by one and followed by an IRules
+   * item. The last item of a declaration or a rule set holds
+   * the memory pool of its terms.
+   */
+  struct Item {
+	enum { IDecl, IRule, IRules } k;
+	char *x;
+	Term t;
+	struct Env *e;
+	struct Pat *p;
+	struct Pool *pool;
+  };
+
+  static void item(struct Lex *, int, char *, Term, struct Env *, struct Pat *);
+  static void dodecl(char *, Term);
 %}
 
+%define api.pure
+%lex-param {struct Lex *lx}
+%parse-param {struct Lex *lx}
+
 %union {
 	char *id;
 	struct Pat *pat;
-	struct Term *term;
+	Term term;
 	struct Env *env;
 	struct PArr *parr;
 }
@@ -33,14 +69,19 @@
 %type <term> term
 %type <env> bdgs
 
+%code {
+  static int yylex(YYSTYPE *, struct Lex *);
+  static void yyerror(struct Lex *, const char *);
+}
+
 %start top
 
 %right ARROW FATARROW
 
 %%
 top: /* empty */   { }
-   | top decl '.'  { dkfree(); }
-   | top rules '.' { dorules(); }
+   | top decl '.'  { if (lx->items) item(lx, IDecl, 0, 0, 0, 0); else dkfree(); }
+   | top rules '.' { if (lx->items) item(lx, IRules, 0, 0, 0, 0); else dorules(); }
 ;
 
 rules: rule
@@ -48,19 +89,18 @@ rules: rule
 ;
 
 decl: ID ':' term {
-	char *id;
-
-	id=mqual($1);
-	if (tscope($3, 0)) {
-		fprintf(stderr, "%s: Scope error in type of %s.\n", __func__, $1);
-		exit(1); // FIXME
-	}
-	gendecl(id, $3);
-	pushscope(id);
+	if (lx->items)
+		item(lx, IDecl, $1, $3, 0, 0);
+	else
+		dodecl($1, $3);
 };
 
-rule: '[' bdgs ']' pat LONGARROW term { pushrule($2, $4, $6); }
-;
+rule: '[' bdgs ']' pat LONGARROW term {
+	if (lx->items)
+		item(lx, IRule, 0, $6, $2, $4);
+	else
+		pushrule($2, $4, $6);
+};
 
 bdgs: /* empty */          { $$ = 0; }
     | bdgs ',' ID ':' term { $$ = eins($1, $3, $5); }
@@ -71,7 +111,7 @@ pat: ID dotps spats { $$ = mkpat($1, $2, $3); }
 ;
 
 dotps: /* empty */        { $$ = 0; }
-     | dotps '{' term '}' { $$ = pains($1, $3); }
+     | dotps '{' term '}' { $$ = pains($1, (void *)(uintptr_t)$3); }
 ;
 
 spats: /* empty */ { $$ = 0; }
@@ -84,7 +124,7 @@ spat: ID          { $$ = mkpat($1, 0, 0); }
 
 sterm: ID           { $$ = mkvar($1); }
      | '(' term ')' { $$ = $2; }
-     | TYPE         { $$ = ttype; }
+     | TYPE         { $$ = mktype(); }
 ;
 
 app: sterm     { $$ = $1; }
@@ -99,24 +139,69 @@ term: app                      { $$ = $1; }
 ;
 %%
 
+/* internal dodecl - Process a declaration, its type is scoped
+ * and code is generated for it.
+ */
+static void
+dodecl(char *x, Term t)
+{
+	char *id;
+
+	id=mqual(x);
+	if (tscope(t, 0)) {
+		fprintf(stderr, "%s: Scope error in type of %s.\n", __func__, x);
+		exit(1); // FIXME
+	}
+	gendecl(id, t);
+	pushscope(id);
+}
+
+/* internal item - Record a top-level item, if it is the end of
+ * a declaration or of a rule set, the current memory pool is
+ * detached and stored in the item. The IDecl item ending a
+ * declaration is merged with the one recording it.
+ */
+static void
+item(struct Lex *lx, int k, char *x, Term t, struct Env *e, struct Pat *p)
+{
+	struct Item it = { k, x, t, e, p, 0 };
+
+	if (k==IDecl && !x) {
+		((struct Item *)stop(lx->items))->pool=pdetach();
+		return;
+	}
+	if (k==IRules)
+		it.pool=pdetach();
+	spush(lx->items, &it);
+}
+
+/* internal lgetc lungetc - Read and push back a character of
+ * the lexer input, they are macros since the lexer calls them
+ * once per character.
+ */
+#define lgetc(lx) ((lx)->f ? getc((lx)->f) \
+	: (lx)->p<(lx)->e ? (unsigned char)*(lx)->p++ : EOF)
+#define lungetc(c, lx) ((lx)->f ? (void)ungetc((c), (lx)->f) \
+	: (void)((c)!=EOF && (lx)->p--))
+
 static int
-peek(void)
+peek(struct Lex *lx)
 {
-	int c = fgetc(f);
-	if (c!=EOF) ungetc(c, f);
+	int c = lgetc(lx);
+	lungetc(c, lx);
 	return c;
 }
 
 static int
-skipspaces(void)
+skipspaces(struct Lex *lx)
 {
 	int c;
 	while (1) {
-		while ((c=fgetc(f))!=EOF && isspace(c));
-		if (c!='(' || peek()!=';')
+		while ((c=lgetc(lx))!=EOF && isspace(c));
+		if (c!='(' || peek(lx)!=';')
 			return c;
-		while ((fgetc(f)!=';' || peek()!=')') && !feof(f));
-		fgetc(f); /* Drop trailing ')'. */
+		while ((c=lgetc(lx))!=EOF && (c!=';' || peek(lx)!=')'));
+		lgetc(lx); /* Drop trailing ')'. */
 	}
 }
 
@@ -127,28 +212,28 @@ istoken(int c)
 }
 
 static int
-yylex(void)
+yylex(YYSTYPE *lval, struct Lex *lx)
 {
-	static char tok[IDLEN];
+	char tok[IDLEN];
 	int l, c, qual;
 
-	c=skipspaces();
+	c=skipspaces(lx);
 	if (c==EOF)
 		return 0;
 	if (strchr("[]{}(),.:", c))
 		return c;
 	if (c=='-' || c=='=') {
-		switch (fgetc(f)) {
+		switch (lgetc(lx)) {
 		case '>':
 			return c=='-' ? ARROW : FATARROW;
 		case '-':
-			if (c=='-' && fgetc(f)=='>')
+			if (c=='-' && lgetc(lx)=='>')
 				return LONGARROW;
 			break;
 		}
 		return c; /* This is an error. */
 	}
-	for (qual=l=0; c!=EOF && (istoken(c) || (c=='.' && istoken(peek()))); l++) {
+	for (qual=l=0; c!=EOF && (istoken(c) || (c=='.' && istoken(peek(lx)))); l++) {
 		if (l>=IDLEN-1) {
 			fputs("Maximum identifier length exceeded.\n", stderr);
 			exit(1);
@@ -156,38 +241,146 @@ yylex(void)
 		if (c=='.')
 			qual=l+1;
 		tok[l]=c;
-		c=fgetc(f);
+		c=lgetc(lx);
 	}
 	tok[l]=0;
 	if (!l)
 		return c; /* This is an error. */
-	if (c!=EOF)
-		ungetc(c, f); /* Push back last char. */
+	lungetc(c, lx); /* Push back last char. */
 	if (strcmp(tok, "Type")==0)
 		return TYPE;
-	yylval.id=astrdup(tok, qual);
+	lval->id=astrdup(tok, qual);
 	return ID;
 }
 
 static void
-yyerror(const char *m)
+yyerror(struct Lex *lx, const char *m)
 {
 	fprintf(stderr, "Yacc error, %s.\n", m);
 	exit(1);
 }
 
+/* ------------- Parallel parsing. ------------- */
+
+/* internal split - Split the buffer between p and e in at most
+ * n chunks of similar sizes, chunks end just after the dot
+ * terminating a top-level item. The end of each chunk is
+ * stored in cut and the number of chunks is returned.
+ */
+static int
+split(const char *p, const char *e, int n, const char **cut)
+{
+	size_t sz=(e-p)/n;
+	const char *s=p;
+	int k=0, tok=0;
+
+	for (; p<e; p++) {
+		if (*p=='(' && p+1<e && p[1]==';') {
+			for (p+=2; p+1<e && (p[0]!=';' || p[1]!=')'); p++)
+				;
+			p++;
+			tok=0;
+			continue;
+		}
+		if (*p=='.' && !(tok && p+1<e && istoken(p[1]))) {
+			if (k<n-1 && (size_t)(p+1-s)>=sz)
+				s=cut[k++]=p+1;
+			tok=0;
+			continue;
+		}
+		tok=istoken(*p);
+	}
+	cut[k++]=e;
+	return k;
+}
+
+/* internal pchunk - Parse one chunk, this is the entry point
+ * of parsing threads.
+ */
+static void *
+pchunk(void *a)
+{
+	struct Lex *lx=a;
+
+	pdetach(); /* Create the pool of this thread. */
+	yyparse(lx);
+	padopt(0);
+	return 0;
+}
+
+/* internal pparse - Parse the file f using n threads, the
+ * recorded items are then processed in order.
+ */
+static void
+pparse(FILE *f, int n)
+{
+	const char *cut[n];
+	struct Stk items[n];
+	struct Lex lx[n];
+	pthread_t th[n];
+	struct Item *it;
+	char *buf;
+	size_t sz, r;
+	int i, k;
+
+	for (buf=0, sz=r=0; !feof(f); r+=fread(buf+r, 1, sz-r, f))
+		if (r==sz)
+			buf=xrealloc(buf, sz=sz?2*sz:BUFSIZ);
+	n=split(buf, buf+r, n, cut);
+	for (i=0; i<n; i++) {
+		items[i]=(struct Stk)STK(struct Item);
+		lx[i]=(struct Lex){ 0, i?cut[i-1]:buf, cut[i], &items[i] };
+		if (pthread_create(&th[i], 0, pchunk, &lx[i])) {
+			fprintf(stderr, "%s: Cannot create thread.\n", __func__);
+			exit(1); // FIXME
+		}
+	}
+	for (i=0; i<n; i++)
+		pthread_join(th[i], 0);
+	free(buf);
+
+	for (i=0; i<n; i++) {
+		it=(struct Item *)items[i].p;
+		for (k=0; k<items[i].i; k++, it++) {
+			if (k==0 || it[-1].pool) {
+				struct Item *end;
+				for (end=it; !end->pool; end++)
+					;
+				padopt(end->pool);
+			}
+			switch (it->k) {
+			case IDecl:
+				dodecl(it->x, it->t);
+				dkfree();
+				break;
+			case IRule:
+				pushrule(it->e, it->p, it->t);
+				break;
+			case IRules:
+				dorules();
+				break;
+			}
+		}
+		free(items[i].p);
+	}
+}
+
+/* internal opengfile - Open the file of the compiled current
+ * module, its path is the module name where dots are replaced
+ * by slashes, with the .lua extension.
+ */
 static int
-opengfile(char *mod)
+opengfile(void)
 {
+	const char *m=mget();
 	char *f, *p;
 
-	f=xalloc(strlen(mod)+5);
-	strcpy(f, mod);
-	if (!(p=strrchr(f, '.')))
-		p=f+strlen(f);
+	f=xalloc(strlen(m)+5);
+	for (p=f; *m; m++)
+		*p++=*m=='.'?'/':*m;
 	strcpy(p, ".lua");
 
-	if (!(gfile=fopen(f, "w"))) {
+	if (!(gfile=fopen(f, "w+"))) {
 		fprintf(stderr, "Cannot open %s.\n", f);
 		free(f);
 		return 1;
@@ -196,41 +389,100 @@ opengfile(char *mod)
 	return 0;
 }
 
+static void
+usage(char *p)
+{
+	printf("usage: %s [-c | -k] [-n] [-p] [-t] [-j N] [-l BUNDLE] [-r PROFILE] [-m NAME] FILES\n", p);
+	exit(1);
+}
+
 int
 main(int argc, char **argv)
 {
+	char *prog=argv[0]?argv[0]:"dkparse", *prof=0, *link=0, *mod=0, *name;
+	int jobs=1;
+	FILE *f;
+
 	gmode=Check;
-	if (argc<2) {
-		printf("usage: %s [-c] FILES\n", argv[0]?argv[0]:"dkparse");
-		exit(1);
-	}
-	if (strcmp(argv[1], "-c")==0) {
-		gmode=Compile;
-		argv++, --argc;
+	for (argv++, argc--; argc && **argv=='-' && (*argv)[1]; argv++, argc--) {
+		if (strcmp(*argv, "-c")==0 && gmode!=Native)
+			gmode=Compile;
+		else if (strcmp(*argv, "-k")==0 && gmode!=Compile)
+			gmode=Native;
+		else if (strcmp(*argv, "-n")==0)
+			glazy=1;
+		else if (strcmp(*argv, "-p")==0)
+			gprof=1;
+		else if (strcmp(*argv, "-t")==0)
+			gpipe=1;
+		else if (strcmp(*argv, "-j")==0 && argc>1 && atoi(argv[1])>0)
+			jobs=atoi(*++argv), argc--;
+		else if (strcmp(*argv, "-r")==0 && argc>1)
+			prof=*++argv, argc--;
+		else if (strcmp(*argv, "-l")==0 && argc>1)
+			link=*++argv, argc--;
+		else if (strcmp(*argv, "-m")==0 && argc>1)
+			mod=*++argv, argc--;
+		else
+			usage(prog);
 	}
+	if (argc<1 || (link && gmode==Native)) /* Bundles hold compiled code. */
+		usage(prog);
 	initalloc();
 	initscope();
-	while (argv++, --argc) {
-		if (!(f=fopen(*argv, "r"))) {
+	if (prof && profload(prof))
+		exit(1);
+	if (link) {
+		if (!(glink=fopen(link, "w+"))) {
+			fprintf(stderr, "Cannot open %s.\n", link);
+			exit(1);
+		}
+		gmode=Compile;
+	}
+	/* A module named with -m is read from a stream, the file
+	 * "-" is the standard input, and its code is flushed after
+	 * each item.
+	 */
+	for (; argc; argv++, argc--) {
+		if (strcmp(*argv, "-m")==0 && argc>1) {
+			mod=*++argv, argc--;
+			continue;
+		}
+		name=mod, mod=0;
+		if (strcmp(*argv, "-")==0) {
+			if (!name) {
+				fprintf(stderr, "Missing module name of the standard input.\n");
+				continue;
+			}
+			f=stdin;
+		} else if (!(f=fopen(*argv, "r"))) {
 			fprintf(stderr, "Cannot open %s.\n", *argv);
 			continue;
 		}
-		if (mset(*argv)) {
-			fprintf(stderr, "Invalid module name %s.\n", *argv);
+		if (name?mname(name):mset(*argv)) {
+			fprintf(stderr, "Invalid module name %s.\n", name?name:*argv);
 			continue;
 		}
-		if (gmode==Compile) {
-			if (opengfile(*argv))
+		gflush=name!=0;
+		if (gmode==Compile && !glink) {
+			if (opengfile())
 				continue;
 		} else
 			gfile=stdout;
 		fprintf(stderr, "Parsing module %s.\n", mget());
 		genmod();
-		yyparse();
-		fclose(f);
-		if (gmode==Compile)
-			fclose(gfile);
+		if (jobs>1)
+			pparse(f, jobs);
+		else
+			yyparse(&(struct Lex){ f });
+		genend();
+		if (f!=stdin)
+			fclose(f);
 	}
+	genwait();
+	genlink();
+	if (gmode==Native)
+		kdeinit();
 	deinitscope();
 	deinitalloc();
 	exit(0);
@@ -1,8 +1,11 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "dk.h"
-#define emit(...) fprintf(gfile, __VA_ARGS__)
+#include "lib/avl.h"
+#define emit(...) fprintf(gout, __VA_ARGS__)
 
 /* ------------- Global settings. ------------- */
 
@@ -15,10 +18,191 @@
  */
 enum GenMode gmode;
 
-/* gfile - The file in which generated code is printed.
+/* gfile - The file in which the code of the next module will
+ * be printed.
  */
 FILE *gfile;
 
+/* gpipe - If this flag is set, code is generated by a separate
+ * thread, the parser hands it declarations through a queue.
+ */
+int gpipe;
+
+/* gflush - If this flag is set, the code of the next module
+ * is flushed after each declaration and rule set, a consumer
+ * reading it through a pipe gets every item once generated.
+ */
+int gflush;
+
+/* internal gout gfl - The file in which generated code is
+ * printed and the flag gflush of the current module.
+ */
+static FILE *gout;
+static int gfl;
+
+/* gprof - If this flag is set, the code generated for rule
+ * sets will count the branches taken in decision trees, the
+ * counts are dumped by the runtime at the end of each module.
+ */
+int gprof;
+
+/* glazy - If this flag is set, arguments which are applications
+ * are passed as thunks and evaluated by need, the runtime forces
+ * them when they are scrutinized.
+ */
+int glazy;
+
+/* ------------- Pattern paths. ------------- */
+
+/* internal pdepth - Return the length of the path of the sub
+ * pattern p, this is its depth below the head of the rule.
+ */
+static int
+pdepth(struct Pat *p)
+{
+	int n;
+
+	for (n=0; p->up; p=p->up)
+		n++;
+	return n;
+}
+
+/* internal ppath - Return the 0 terminated path of the sub
+ * pattern p, it is stored in a buffer owned by ppath and is
+ * valid until the next call.
+ */
+static int *
+ppath(struct Pat *p)
+{
+	static struct Stk path = STK(int);
+	int n=pdepth(p), z=0, *q;
+
+	for (path.i=0; path.i<=(size_t)n;)
+		spush(&path, &z);
+	q=(int *)path.p;
+	for (; p->up; p=p->up)
+		q[--n]=p->a;
+	return q;
+}
+
+/* ------------- Rule profiles. ------------- */
+
+/* MAXPLEN - Maximum size of a path printed as a string.
+ */
+#define MAXPLEN 64
+
+/* struct PEnt - A profile entry, it stores how many times
+ * the constructor c was matched at the path p in the rule
+ * set defining x. The default branch of a decision tree is
+ * recorded with c equal to "_".
+ */
+struct PEnt {
+	char *x, *c;
+	char p[MAXPLEN];
+	unsigned long n;
+};
+
+/* internal prof - The profile loaded by profload, this is
+ * 0 if no profile was loaded.
+ */
+static struct Tree *prof;
+
+/* internal pecmp - Compare two profile entries, atoms are
+ * compared by address.
+ */
+static int
+pecmp(void *a, void *b)
+{
+	struct PEnt *pa=a, *pb=b;
+
+	if (pa->x!=pb->x)
+		return pa->x<pb->x ? -1 : 1;
+	if (pa->c!=pb->c)
+		return pa->c<pb->c ? -1 : 1;
+	return strcmp(pa->p, pb->p);
+}
+
+/* internal strpath - Print the path of a sub pattern in a
+ * string of MAXPLEN bytes. The path { 2, 1 } is printed as
+ * "2.1". If the string is too small, 1 is returned, 0
+ * otherwise.
+ */
+static int
+strpath(char *s, struct Pat *p)
+{
+	int i, n, l, *path=ppath(p);
+
+	for (l=i=0; path[i]; i++, l+=n) {
+		n=snprintf(s+l, MAXPLEN-l, i?".%d":"%d", path[i]);
+		if (n>=MAXPLEN-l)
+			return 1;
+	}
+	return 0;
+}
+
+/* internal atomize - Return the atom of a qualified name read
+ * from a profile file.
+ */
+static char *
+atomize(char *s)
+{
+	char *p=strrchr(s, '.');
+	return astrdup(s, p?p-s+1:0);
+}
+
+/* profload - Load a profile dumped by the runtime. Each line
+ * of a profile has the form "x path c n". If the file cannot
+ * be read or is malformed, 1 is returned, 0 otherwise.
+ */
+int
+profload(char *file)
+{
+	char x[IDLEN], c[IDLEN];
+	struct PEnt *pe, e;
+	FILE *f;
+	int r;
+
+	if (!(f=fopen(file, "r"))) {
+		fprintf(stderr, "%s: Cannot open %s.\n", __func__, file);
+		return 1;
+	}
+	if (!prof)
+		prof=avlnew(pecmp, free);
+	while ((r=fscanf(f, "%127s %63s %127s %lu", x, e.p, c, &e.n))==4) {
+		e.x=atomize(x);
+		e.c=atomize(c);
+		if ((pe=avlget(&e, prof))) {
+			pe->n+=e.n;
+			continue;
+		}
+		pe=xalloc(sizeof *pe);
+		*pe=e;
+		avlins(pe, prof);
+	}
+	fclose(f);
+	if (r!=EOF) {
+		fprintf(stderr, "%s: Malformed profile %s.\n", __func__, file);
+		return 1;
+	}
+	return 0;
+}
+
+/* internal pcount - Return the number of times the constructor
+ * c was matched at the path of p in the rule set defining x.
+ */
+static unsigned long
+pcount(char *x, struct Pat *p, char *c)
+{
+	struct PEnt e, *pe;
+
+	if (!prof || strpath(e.p, p))
+		return 0;
+	e.x=x;
+	e.c=c;
+	pe=avlget(&e, prof);
+	return pe?pe->n:0;
+}
+
 /* ------------- Pattern matrices. ------------- */
 
 /* struct PMat - A pattern matrix.
@@ -147,6 +331,75 @@ pmdef(struct PMat m, int c)
 	return n;
 }
 
+/* internal pmcons - Store the distinct constructors of the
+ * column c in the array cs, the number of constructors is
+ * returned. The constructors are sorted by decreasing number
+ * of matches in the profile of the rule set defining x, rows
+ * order is used to break ties. The match counts are stored in
+ * ns. The arrays cs and ns must have at least m.r elements.
+ */
+static int
+pmcons(struct PMat m, int c, struct Pat **cs, unsigned long *ns, char *x)
+{
+	int i, j, n;
+	unsigned long k;
+	struct Pat *p;
+
+	for (n=i=0; i<m.r; i++) {
+		p=m.m[i][c];
+		if (p->np<0)
+			continue;
+		for (j=0; j<n; j++)
+			if (cs[j]->c==p->c)
+				break;
+		if (j<n)
+			continue;
+		k=pcount(x, p, p->c);
+		for (j=n++; j>0 && ns[j-1]<k; j--) {
+			cs[j]=cs[j-1];
+			ns[j]=ns[j-1];
+		}
+		cs[j]=p;
+		ns[j]=k;
+	}
+	return n;
+}
+
+/* internal pmcol - Select the column to be tested first, the
+ * pattern of the first row in this column must be a constructor.
+ * If no such column exists, m.c is returned.
+ * Without profile, the leftmost column is chosen, otherwise the
+ * column which minimizes the expected number of tests is
+ * selected.
+ */
+static int
+pmcol(struct PMat m, char *x)
+{
+	int c, b, i, n;
+	unsigned long ns[m.r], t, d;
+	double e, be;
+	struct Pat *cs[m.r];
+
+	for (b=-1, be=0, c=0; c<m.c; c++) {
+		if (m.m[0][c]->np<0)
+			continue;
+		if (!prof)
+			return c;
+		n=pmcons(m, c, cs, ns, x);
+		d=pcount(x, cs[0], atomize("_"));
+		for (t=d, e=n*(double)d, i=0; i<n; i++) {
+			t+=ns[i];
+			e+=(i+1)*(double)ns[i];
+		}
+		e=t?e/t:n;
+		if (b<0 || e<be) {
+			b=c;
+			be=e;
+		}
+	}
+	return b<0?m.c:b;
+}
+
 /* ------------- Code generation. ------------- */
 
 /* This code generation section is splitted in four parts, the
@@ -164,32 +417,789 @@ pmdef(struct PMat m, int c)
  */
 enum NameKind { C, T };
 
+/* Kinds of runtime objects, they are stored in the first slot
+ * of the arrays representing terms and code. They must match
+ * the numbers defined in lua/dedukti.lua.
+ */
+enum { CThk, CLam, CPi, CCon, CVar, CType, CKind };
+enum { TLam=7, TLet, TPi, TApp, TType, TBox };
+
 static void gccon(char *, int);
+static void gtbox(char *, Term);
 static char *gname(enum NameKind, char *);
-static void gterm(struct Term *);
-static void gcode(struct Term *);
+static void gid(enum NameKind, char *);
+static void gterm(Term);
+static void gcode(Term);
 static void gpterm(struct Pat *);
-static void gpcode(struct Pat *);
+static void gkey(FILE *);
+
+/* ------------- Module loading. ------------- */
+
+/* Modules referred to by the generated code and which are not
+ * defined in the same output are loaded by the runtime, on
+ * demand, from their compiled file. Before the code of an item,
+ * a dkload directive is emitted for each such module used by
+ * the item which was not seen before in the output.
+ */
+
+/* internal known - The modules known in the current output, in
+ * check mode, the modules generated before are locals of the
+ * output, in compile mode, each module has its own output.
+ */
+static struct Stk known = STK(char *);
+
+/* internal gknown - Check if the module of length l at the
+ * beginning of m is known.
+ */
+static int
+gknown(const char *m, size_t l)
+{
+	char **k=(char **)known.p;
+	size_t i;
+
+	for (i=0; i<known.i; i++)
+		if (strncmp(k[i], m, l)==0 && k[i][l]==0)
+			return 1;
+	return 0;
+}
+
+/* internal gknow - Add the module m to the known modules. In
+ * compile mode, a new output is started by each module, the
+ * previous modules are forgotten.
+ */
+static void
+gknow(const char *m)
+{
+	char *k;
+
+	if (gmode==Compile)
+		while (known.i) {
+			spop(&known, &k);
+			free(k);
+		}
+	k=strcpy(xalloc(strlen(m)+1), m);
+	spush(&known, &k);
+}
+
+/* internal gload - Emit the directive loading the module of the
+ * global symbol x if it is not known, it becomes known.
+ */
+static void
+gload(char *x)
+{
+	size_t l=aqual(x)-1;
+	char *k;
+
+	if (gknown(x, l))
+		return;
+	k=xalloc(l+1);
+	memcpy(k, x, l);
+	k[l]=0;
+	spush(&known, &k);
+	emit("dkload(\"%s\")\n", k);
+}
+
+/* internal napp - The number of applications met by gscan.
+ */
+static int napp;
+
+/* internal gscan - Call f on every global symbol occurring in
+ * the term t, applications are counted in napp.
+ */
+static void
+gscan(Term t, void (*f)(char *))
+{
+	static struct Stk ts = STK(Term);
+	size_t b=ts.i;
+
+	spush(&ts, &t);
+	while (ts.i>b) {
+		spop(&ts, &t);
+		switch (tkind(t)) {
+		case Var:
+			if (aqual(tx(t)))
+				f(tx(t));
+			break;
+		case Lam:
+			spush(&ts, &tr(t));
+			break;
+		case Pi:
+			spush(&ts, &tr(t));
+			spush(&ts, &tl(t));
+			break;
+		case App:
+			napp++;
+			spush(&ts, &tr(t));
+			spush(&ts, &tl(t));
+			break;
+		case Type:
+			break;
+		}
+	}
+}
+
+/* internal gpscan - Call f on every global symbol occurring in
+ * the pattern p.
+ */
+static void
+gpscan(struct Pat *p, void (*f)(char *))
+{
+	static struct Stk ps = STK(struct Pat *);
+	size_t b=ps.i;
+	int i;
+
+	spush(&ps, &p);
+	while (ps.i>b) {
+		spop(&ps, &p);
+		if (aqual(p->c))
+			f(p->c);
+		if (p->np<0)
+			continue;
+		for (i=0; i<p->nd; i++)
+			gscan(p->ds[i], f);
+		for (i=p->np-1; i>=0; i--)
+			spush(&ps, &p->ps[i]);
+	}
+}
+
+/* internal gescan - Call the function in pf on every global
+ * symbol of the type t, this is a helper for eiter.
+ */
+static void
+gescan(char *x, Term t, void *pf)
+{
+	gscan(t, *(void (**)(char *))pf);
+}
+
+/* internal grsscan - Call f on every global symbol occurring
+ * in the code generated for the rule set rs, in compile mode,
+ * only right hand sides are compiled.
+ */
+static void
+grsscan(struct RSet *rs, void (*f)(char *))
+{
+	int i;
+
+	for (i=0; i<rs->i; i++) {
+		if (gmode==Check) {
+			eiter(rs->s[i].e, gescan, &f);
+			gpscan(rs->s[i].l, f);
+		}
+		gscan(rs->s[i].r, f);
+	}
+}
+
+/* ------------- Local aliases. ------------- */
+
+/* The code of an item (a declaration or a rule set) is wrapped
+ * in a function run by the runtime function item, this bounds
+ * the constants and locals of each Lua function, however large
+ * the module is. The function starts with a prelude which binds
+ * the runtime helpers and the global symbols of other modules
+ * used by the item to locals. Symbols of the current module are
+ * not bound, rewrite rules given later can redefine them. The
+ * symbols of an item are collected by a scan of its terms before
+ * its code is generated, the most used ones are bound to locals
+ * and the others are stored in the local table xs.
+ */
+
+/* GMAXAL - Maximum number of locals bound to global symbols
+ * in a prelude, Lua 5.1 limits the number of upvalues of a
+ * function to 60.
+ */
+#define GMAXAL 40
+
+/* GMAXUPV - Maximum number of module tables the function of
+ * an item can refer to, in a bundle module tables are locals
+ * and items referring to more of them are wrapped in a block.
+ */
+#define GMAXUPV 60
+
+/* ATABSZ - Size of the hash table of the symbols of an item,
+ * it must be a power of 2.
+ */
+#define ATABSZ 4096
+
+/* struct GAl - A global symbol of the current item, n counts
+ * its occurrences, o is its rank of first occurrence and a
+ * gives its alias. If a is positive, the symbol is bound to
+ * the locals xa (code) and ta (term), if it is negative, it
+ * is stored at -a (code) and -a+1 (term) in xs, if it is 0
+ * the symbol is not bound. The names of the aliases and their
+ * lengths are kept in s and l, indexed by name kind. The entry
+ * is valid in the item numbered g.
+ */
+struct GAl {
+	char *x;
+	unsigned g;
+	int n, o, a;
+	char s[2][16];
+	int l[2];
+};
+
+/* internal atab agen als - The hash table of the symbols of
+ * the current item, the number of the current item (0 when no
+ * item is generated) and the symbols of the item, in order.
+ * The flag afull is set when a symbol does not fit in the
+ * table and afun is set when the item is wrapped in a function.
+ */
+static struct GAl atab[ATABSZ];
+static unsigned agen, anum;
+static int afull, afun;
+static struct Stk als = STK(struct GAl *);
+
+/* internal gcur - The module being generated.
+ */
+static char *gcur;
+
+/* internal alook - Find the symbol x of the current item, it
+ * is added if mk is set. If the symbol is not found or if the
+ * table is too full, 0 is returned.
+ */
+static struct GAl *
+alook(char *x, int mk)
+{
+	size_t h=((size_t)x>>4)&(ATABSZ-1), i;
+	struct GAl *a;
+
+	for (i=0; i<ATABSZ; i++, h=(h+1)&(ATABSZ-1)) {
+		a=&atab[h];
+		if (a->g!=agen) {
+			if (!mk || als.i>=ATABSZ/2)
+				return 0;
+			a->x=x;
+			a->g=agen;
+			a->n=a->a=0;
+			a->o=als.i;
+			spush(&als, &a);
+			return a;
+		}
+		if (a->x==x)
+			return a;
+	}
+	return 0;
+}
+
+/* internal gref - Record an occurrence of the global symbol x
+ * in the current item. Outside of bundles, the module of x is
+ * loaded if needed.
+ */
+static void
+gref(char *x)
+{
+	size_t l=aqual(x)-1;
+	struct GAl *a;
+
+	if (strncmp(x, gcur, l)==0 && gcur[l]==0)
+		return;
+	if (!(a=alook(x, 1)))
+		afull=1;
+	if (!glink && (!a || a->n==0))
+		gload(x);
+	if (a)
+		a->n++;
+}
+
+/* internal aupv - Return the number of module tables of the
+ * bundle the current item refers to, the result is capped to
+ * GMAXUPV+1. This is an upper bound, the modules past the first
+ * LMAXLOC ones are not locals.
+ */
+static int
+aupv(void)
+{
+	struct GAl **as=(struct GAl **)als.p;
+	char *ms[GMAXUPV+1];
+	size_t i, l;
+	int j, n;
+
+	if (afull)
+		return GMAXUPV+1;
+	ms[0]=gcur;
+	for (n=1, i=0; i<als.i && n<=GMAXUPV; i++) {
+		l=strcspn(as[i]->x, ".");
+		for (j=0; j<n; j++)
+			if (strncmp(ms[j], as[i]->x, l)==0 && (ms[j][l]==0 || ms[j][l]=='.'))
+				break;
+		if (j==n)
+			ms[n++]=as[i]->x;
+	}
+	return n;
+}
+
+/* internal acmp - Order symbols by decreasing number of
+ * occurrences, then by first occurrence.
+ */
+static int
+acmp(const void *pa, const void *pb)
+{
+	const struct GAl *a=*(struct GAl **)pa, *b=*(struct GAl **)pb;
+
+	if (a->n!=b->n)
+		return a->n>b->n ? -1 : 1;
+	return a->o-b->o;
+}
+
+/* internal aset - Set the alias a of the symbol s and build
+ * the names of its aliases.
+ */
+static void
+aset(struct GAl *s, int a)
+{
+	s->a=a;
+	if (a>0) {
+		s->l[C]=sprintf(s->s[C], "x%d", a);
+		s->l[T]=sprintf(s->s[T], "t%d", a);
+	} else {
+		s->l[C]=sprintf(s->s[C], "xs[%d]", -a);
+		s->l[T]=sprintf(s->s[T], "xs[%d]", -a+1);
+	}
+}
+
+/* internal gabeg - Start the function of an item, it is either
+ * the declaration of type t, or the rule set rs. The symbols of
+ * the item are recorded and the prelude binding locals is
+ * emitted.
+ */
+static void
+gabeg(Term t, struct RSet *rs)
+{
+	struct GAl **as;
+	int i, k, l, n, nk=gmode==Check?2:1;
+	const char *hs[2];
+	char *m;
+
+	agen=++anum;
+	als.i=0;
+	afull=0;
+	napp=0;
+	if (rs)
+		grsscan(rs, gref);
+	else
+		gscan(t, gref);
+	afun=!glink || aupv()<=GMAXUPV;
+	emit(afun?"item(function ()\n":"do\n");
+	as=(struct GAl **)als.p;
+	k=0;
+	if (napp)
+		hs[k++]=glink?"ap, apn":"ap";
+	if (rs && glazy)
+		hs[k++]="fc";
+	if (!k && !als.i)
+		return;
+	qsort(as, als.i, sizeof *as, acmp);
+	n=als.i<GMAXAL/nk?als.i:GMAXAL/nk;
+	emit("local ");
+	for (i=0; i<k; i++)
+		emit(i?", %s":"%s", hs[i]);
+	for (i=0; i<n; i++) {
+		aset(as[i], i+1);
+		emit(i||k?", x%d":"x%d", i+1);
+		if (nk==2)
+			emit(", t%d", i+1);
+	}
+	emit(" = ");
+	for (i=0; i<k; i++)
+		emit(i?", %s":"%s", hs[i]);
+	for (i=0; i<n; i++) {
+		m=amangle(as[i]->x, &l);
+		emit(i||k?", %s":"%s", m);
+		if (nk==2)
+			emit(", %s", m+l+1);
+	}
+	emit("\n");
+	if (n<als.i) {
+		emit("local xs = { ");
+		for (i=n; i<als.i; i++) {
+			aset(as[i], -(i-n)*nk-1);
+			m=amangle(as[i]->x, &l);
+			emit(i>n?", %s":"%s", m);
+			if (nk==2)
+				emit(", %s", m+l+1);
+		}
+		emit(" }\n");
+	}
+}
+
+/* internal gaend - End the function of the current item, the
+ * item is complete and the output is flushed if needed.
+ */
+static void
+gaend(void)
+{
+	emit(afun?"end)\n\n":"end\n\n");
+	agen=0;
+	if (gfl)
+		fflush(gout);
+}
+
+/* internal galias - Return the global symbol x of the current
+ * item if it has an alias of kind nk, otherwise 0 is returned.
+ */
+static inline struct GAl *
+galias(enum NameKind nk, char *x)
+{
+	struct GAl *a;
+
+	if (!agen || (nk==T && gmode!=Check))
+		return 0;
+	if (!(a=alook(x, 0)) || !a->a)
+		return 0;
+	return a;
+}
+
+/* ------------- Module linking. ------------- */
+
+/* In link mode, the compiled modules are not printed as they
+ * are generated, the code of each declaration and rule set is
+ * stored in a temporary file and the global symbols it refers
+ * to are recorded. At the end of the run, genlink prints the
+ * items reachable from the symbols of the last module in a
+ * single bundle where module tables are locals.
+ */
+
+/* glink - If this file is not null, the compiled modules are
+ * linked in a bundle printed in this file.
+ */
+FILE *glink;
+
+/* LMAXLOC - Maximum number of module tables which are locals
+ * in a bundle, Lua limits the number of locals in a function
+ * to 200.
+ */
+#define LMAXLOC 150
+
+/* LMAXAPN - Maximum number of arguments of a direct call.
+ */
+#define LMAXAPN 32
+
+/* struct LItem - A compiled declaration or rule set, its code
+ * is stored in the temporary file at offset off, m is the index
+ * of its module, rs is the array of the nr global symbols it
+ * refers to and n is the next item of the same symbol.
+ */
+struct LItem {
+	long off, len;
+	int m, nr;
+	char **rs;
+	struct LSym *s;
+	struct LItem *n;
+};
+
+/* struct LSym - A global symbol of the linked modules, ar is
+ * the arity of its rewrite rules, it is 0 if the symbol has no
+ * rules. The items of the symbol are chained from is.
+ */
+struct LSym {
+	char *x;
+	int ar, live;
+	struct LItem *is, **last;
+};
+
+/* internal ltmp lsyms litems lmods - The temporary file storing
+ * the code of items, the tree of symbols, and the stacks of
+ * items and module names, in order.
+ */
+static FILE *ltmp;
+static struct Tree *lsyms;
+static struct Stk litems = STK(struct LItem *);
+static struct Stk lmods = STK(char *);
+
+/* internal lcur loff lrefs - The symbol of the item being
+ * generated, the offset of its code and the global symbols
+ * it refers to.
+ */
+static struct LSym *lcur;
+static long loff;
+static struct Stk lrefs = STK(char *);
+
+/* internal lcmp - Compare two symbols, atoms are compared by
+ * address.
+ */
+static int
+lcmp(void *a, void *b)
+{
+	char *xa=((struct LSym *)a)->x, *xb=((struct LSym *)b)->x;
+
+	if (xa==xb)
+		return 0;
+	return xa<xb ? -1 : 1;
+}
+
+/* internal lget - Return the symbol x, it is created if it is
+ * not found and mk is set, otherwise 0 is returned.
+ */
+static struct LSym *
+lget(char *x, int mk)
+{
+	struct LSym k, *s;
+
+	if (!lsyms) {
+		if (!mk)
+			return 0;
+		lsyms=avlnew(lcmp, free);
+	}
+	k.x=x;
+	if ((s=avlget(&k, lsyms)) || !mk)
+		return s;
+	s=xalloc(sizeof *s);
+	s->x=x;
+	s->ar=s->live=0;
+	s->is=0;
+	s->last=&s->is;
+	avlins(s, lsyms);
+	return s;
+}
+
+/* internal lbeg - Start the item defining the symbol x, the
+ * code generated is redirected to the temporary file.
+ */
+static void
+lbeg(char *x)
+{
+	if (!ltmp && !(ltmp=tmpfile())) {
+		fprintf(stderr, "%s: Cannot create temporary file.\n", __func__);
+		exit(1); // FIXME
+	}
+	gout=ltmp;
+	lcur=lget(x, 1);
+	loff=ftell(ltmp);
+	lrefs.i=0;
+}
+
+/* internal lref - Record a reference to the global symbol x
+ * in the current item.
+ */
+static inline void
+lref(char *x)
+{
+	if (!lcur || x==lcur->x)
+		return;
+	if (lrefs.i && *(char **)stop(&lrefs)==x)
+		return;
+	spush(&lrefs, &x);
+}
+
+/* internal lend - End the current item and store it.
+ */
+static void
+lend(void)
+{
+	struct LItem *it=xalloc(sizeof *it);
+
+	it->off=loff;
+	it->len=ftell(ltmp)-loff;
+	it->m=lmods.i-1;
+	it->nr=lrefs.i;
+	it->rs=xalloc(lrefs.i*sizeof *it->rs);
+	memcpy(it->rs, lrefs.p, lrefs.i*sizeof *it->rs);
+	it->s=lcur;
+	it->n=0;
+	*lcur->last=it;
+	lcur->last=&it->n;
+	spush(&litems, &it);
+	lcur=0;
+}
+
+/* internal ldecl - Declare the tables of module m in the
+ * bundle, the prefixes already declared by one of the first
+ * m modules are skipped, nloc counts the local tables.
+ */
+static void
+ldecl(int m, int *nloc)
+{
+	char **ms=(char **)lmods.p, *p;
+	size_t l;
+	int i;
+
+	for (p=ms[m];; p++) {
+		if (*p && *p!='.')
+			continue;
+		l=p-ms[m];
+		for (i=0; i<m; i++)
+			if (strncmp(ms[i], ms[m], l)==0 && (ms[i][l]==0 || ms[i][l]=='.'))
+				break;
+		if (i==m) {
+			if (!memchr(ms[m], '.', l) && (*nloc)++<LMAXLOC)
+				fprintf(glink, "local ");
+			fprintf(glink, "%.*s = { }\n", (int)l, ms[m]);
+		}
+		if (!*p)
+			break;
+	}
+}
+
+/* internal lcopy - Copy an item from the temporary file to the
+ * bundle.
+ */
+static void
+lcopy(struct LItem *it)
+{
+	char buf[BUFSIZ];
+	long n;
+	size_t r;
+
+	fseek(ltmp, it->off, SEEK_SET);
+	for (n=it->len; n>0; n-=r) {
+		r=fread(buf, 1, n<BUFSIZ?n:BUFSIZ, ltmp);
+		if (r==0) {
+			fprintf(stderr, "%s: Cannot read temporary file.\n", __func__);
+			exit(1); // FIXME
+		}
+		fwrite(buf, 1, r, glink);
+	}
+}
+
+/* genlink - Print the bundle of the linked modules. The symbols
+ * of the last module and all the symbols they depend on are
+ * kept, other items are dropped. The module tables which are
+ * locals in the bundle are exported at its end.
+ */
+void
+genlink(void)
+{
+	static struct Stk todo = STK(struct LSym *);
+	struct LItem **its=(struct LItem **)litems.p, *it;
+	char **ms=(char **)lmods.p, *x;
+	struct LSym *s, *r;
+	size_t i, l, nlive;
+	int j, nloc;
+
+	if (!glink || !lmods.i)
+		return;
+	for (i=0; i<litems.i; i++)
+		if (its[i]->m==lmods.i-1 && !its[i]->s->live) {
+			its[i]->s->live=1;
+			spush(&todo, &its[i]->s);
+		}
+	while (todo.i) {
+		spop(&todo, &s);
+		for (it=s->is; it; it=it->n)
+			for (j=0; j<it->nr; j++)
+				if ((r=lget(it->rs[j], 0)) && !r->live) {
+					r->live=1;
+					spush(&todo, &r);
+				}
+	}
+
+	fprintf(glink, "--[[ Bundle of modules");
+	for (i=0; i<lmods.i; i++)
+		fprintf(glink, i?", %s":" %s", ms[i]);
+	fprintf(glink, ". ]]\n");
+	for (nloc=0, i=0; i<lmods.i; i++) {
+		ldecl(i, &nloc);
+		x=strcpy(xalloc(strlen(ms[i])+1), ms[i]);
+		spush(&known, &x);
+	}
+	gout=glink;
+	for (i=0; i<litems.i; i++)
+		if (its[i]->s->live)
+			for (j=0; j<its[i]->nr; j++)
+				if (!lget(its[i]->rs[j], 0))
+					gload(its[i]->rs[j]);
+	fprintf(glink, "\n");
+	for (nlive=0, i=0; i<litems.i; i++) {
+		if (!its[i]->s->live)
+			continue;
+		lcopy(its[i]);
+		nlive++;
+	}
+	for (i=0; i<lmods.i; i++) {
+		l=strcspn(ms[i], ".");
+		for (j=0; j<i; j++)
+			if (strncmp(ms[j], ms[i], l)==0 && (ms[j][l]==0 || ms[j][l]=='.'))
+				break;
+		if (j==i)
+			fprintf(glink, "_G.%.*s = %.*s\n", (int)l, ms[i], (int)l, ms[i]);
+	}
+	fprintf(stderr, "Linked %zu modules, %zu of %zu items kept.\n"
+	              , lmods.i, nlive, litems.i);
+
+	for (i=0; i<litems.i; i++) {
+		free(its[i]->rs);
+		free(its[i]);
+	}
+	for (i=0; i<lmods.i; i++)
+		free(ms[i]);
+	avlfree(lsyms);
+	fclose(ltmp);
+	gkey(glink);
+	fclose(glink);
+}
 
 /* ------------- Module compiling. ------------- */
 
-/* genmod - Generate the code to prepend to a compiled module,
- * it initializes the current module table.
+/* internal gkey - Append its key to the generated file f, it
+ * is a hash of the code of the file, hence of the source module
+ * and of the generator. The runtime uses it to validate the
+ * bytecode cache of the file. The file must be opened for
+ * update.
  */
-void
-genmod(void)
+static void
+gkey(FILE *f)
+{
+	unsigned char buf[BUFSIZ];
+	unsigned long long h=14695981039346656037ULL;
+	size_t i, n;
+
+	fflush(f);
+	rewind(f);
+	while ((n=fread(buf, 1, sizeof buf, f))>0)
+		for (i=0; i<n; i++)
+			h=(h^buf[i])*1099511628211ULL;
+	fseek(f, 0, SEEK_END);
+	fprintf(f, "-- dkkey %016llx\n", h);
+}
+
+/* internal gmod - Generate the code to prepend to the compiled
+ * module m, it initializes the module table.
+ */
+static void
+gmod(const char *m)
 {
-	const char *m, *p, *q;
+	const char *p, *q;
 
-	q=m=mget();
+	if (gmode==Native)
+		return;
+	free(gcur);
+	gcur=strcpy(xalloc(strlen(m)+1), m);
+	if (glink) {
+		q=strcpy(xalloc(strlen(m)+1), m);
+		spush(&lmods, &q);
+		return;
+	}
+	q=m;
+	gknow(m);
 	emit("--[[ Code for module %s. ]]\n", m);
 	if (gmode==Check)
 		emit("local "); /* This line causes a 20% speedup. */
 	while ((p=strchr(q, '.'))) {
-		emit("%.*s = { }\n", (int)(p-m), m);
+		if (gmode==Compile)
+			emit("%.*s = %.*s or { }\n", (int)(p-m), m, (int)(p-m), m);
+		else
+			emit("%.*s = { }\n", (int)(p-m), m);
 		q=p+1;
 	}
-	emit("%s = { }\n\n", m);
+	if (gmode==Compile)
+		emit("%s = %s or { }\n\n", m, m);
+	else
+		emit("%s = { }\n\n", m);
+}
+
+/* internal gend - Generate the code to append to a compiled
+ * module, in compile mode, the output file is closed.
+ */
+static void
+gend(void)
+{
+	if (glink)
+		return;
+	if (gmode!=Native)
+		emit(gprof?"profdump()\nconvstats(true)\n\n":"convstats()\n\n");
+	if (gmode==Compile) {
+		gkey(gout);
+		fclose(gout);
+	}
 }
 
 /* ------------- Rule set compiling. ------------- */
@@ -199,30 +1209,134 @@ genmod(void)
  */
 struct RSet *crs;
 
+/* MAXBND - Maximum number of locals bound to matched sub terms
+ * in a decision tree, Lua limits the number of locals in a
+ * function to 200.
+ */
+#define MAXBND 120
+
+/* struct Bnd - A constructor whose arguments are bound to
+ * locals, n is the length of its path.
+ */
+struct Bnd {
+	struct Pat *p;
+	int n;
+};
+
+/* internal bnd nbnd - Constructors whose arguments are bound
+ * to locals in the branch being generated, and the total number
+ * of such locals. The local bound to the object at path
+ * { 2, 1, 3 } is named y2_1_3.
+ */
+static struct Stk bnd = STK(struct Bnd);
+static int nbnd;
+
+/* internal gbound - Return the length of the longest prefix of
+ * path which is bound to a local. Each binding is compared once
+ * with the prefix of its length, the lengths found are marked.
+ */
+static int
+gbound(int *path)
+{
+	static struct Stk mark = STK(char);
+	struct Bnd *b=(struct Bnd *)bnd.p;
+	struct Pat *p;
+	size_t j;
+	int n, i;
+	char z=0, *m;
+
+	for (n=0, mark.i=0; !n || path[n-1]; n++)
+		spush(&mark, &z);
+	m=mark.p;
+	for (j=0; j<bnd.i; j++) {
+		if (b[j].n>=n-1 || m[b[j].n])
+			continue;
+		for (i=b[j].n, p=b[j].p; p->up && p->a==path[i-1]; p=p->up)
+			i--;
+		if (i==0)
+			m[b[j].n]=1;
+	}
+	for (i=1; path[i] && m[i]; i++)
+		;
+	return i;
+}
+
 /* internal gpath - Generate the expression to access
- * the object stored at the given path.
+ * the object stored at the path of p.
  */
 static inline void
-gpath(int *path)
+gpath(struct Pat *p)
 {
-	int i;
+	int i, n, *path=ppath(p);
 
+	n=gbound(path);
 	emit("y%d", path[0]);
-	for (i=1; path[i]; i++)
-		emit(".args[%d]", path[i]);
+	for (i=1; i<n; i++)
+		emit("_%d", path[i]);
+	for (; path[i]; i++)
+		emit("[%d]", path[i]+2);
+}
+
+/* internal gbind - Bind the arguments of the constructor p that
+ * was just matched to locals, 0 is returned if no local was
+ * bound.
+ */
+static int
+gbind(struct Pat *p)
+{
+	int i, *q, *path;
+	struct Bnd b;
+
+	if (p->np==0 || nbnd+p->np>MAXBND)
+		return 0;
+	path=ppath(p);
+	emit("local ");
+	for (i=0; i<p->np; i++) {
+		emit(i?", y%d":"y%d", path[0]);
+		for (q=path+1; *q; q++)
+			emit("_%d", *q);
+		emit("_%d", p->nd+i+1);
+	}
+	b.p=p;
+	b.n=q-path; /* The path is overwritten by gpath. */
+	emit(" = ");
+	for (i=0; i<p->np; i++) {
+		if (i)
+			emit(", ");
+		gpath(p);
+		emit("[%d]", p->nd+i+3);
+	}
+	emit("\n");
+	spush(&bnd, &b);
+	nbnd+=p->np;
+	return 1;
 }
 
 /* internal gcond - Generate the condition of if statements
  * that guard an entry in the decision tree.
  */
 static void
-gcond(int *path, char *c)
+gcond(struct Pat *p, char *c)
+{
+	emit(glazy?"if fc(":"if ");
+	gpath(p);
+	emit(glazy?")[1] == %d and ":"[1] == %d and ", CCon);
+	gpath(p);
+	emit("[2] == \"%s\" then\n", c);
+}
+
+/* internal gcount - Generate the code counting the matches
+ * of the constructor c at the path of p, in the decision
+ * tree of the current rule set.
+ */
+static void
+gcount(struct Pat *p, char *c)
 {
-	emit("if ");
-	gpath(path);
-	emit(".ck == ccon and ");
-	gpath(path);
-	emit(".ccon == \"%s\" then\n", c);
+	char s[MAXPLEN];
+
+	if (!gprof || strpath(s, p))
+		return;
+	emit("prof(\"%s %s %s\")\n", crs->x, s, c);
 }
 
 /* internal glocals - Generate the binding list local to the
@@ -236,7 +1350,7 @@ glocals(struct Rule *r)
 	if (r->elen==0)
 		return;
 	emit("local ");
-	emit("%s", gname(C, r->vpa[0].x));
+	gid(C, r->vpa[0].x);
 	for (v=1; v<r->elen; v++)
 		emit(", %s", gname(C, r->vpa[v].x));
 	emit(" = ");
@@ -257,8 +1371,9 @@ glocals(struct Rule *r)
 static void
 grules(struct PMat pm)
 {
-	int i, c;
-	struct Pat *p;
+	int i, b, c, n;
+	unsigned long ns[pm.r];
+	struct Pat *cs[pm.r];
 	struct PMat m;
 
 	if (pm.r==0) {
@@ -266,9 +1381,7 @@ grules(struct PMat pm)
 		gccon(crs->x, crs->s[0].l->nd+crs->s[0].l->np);
 		return;
 	}
-	for (c=0; c<pm.c; c++)
-		if (pm.m[0][c]->np>=0)
-			break;
+	c=pmcol(pm, crs->x);
 	if (c==pm.c) {
 		assert(pm.rs[0]<crs->i);
 		glocals(&crs->s[pm.rs[0]]);
@@ -277,22 +1390,23 @@ grules(struct PMat pm)
 		return;
 	}
 
-	p=pm.m[0][c];
-	gcond(p->loc, p->c);
-	m=pmspec(pm, p->c, p->np, c);
-	grules(m);
-
-	for (i=1; i<pm.r; i++) {
-		p=pm.m[i][c];
-		if (p->np<0)
-			continue;
-		emit("\nelse");
-		gcond(p->loc, p->c);
-		m=pmspec(pm, p->c, p->np, c);
+	n=pmcons(pm, c, cs, ns, crs->x);
+	for (i=0; i<n; i++) {
+		if (i)
+			emit("\nelse");
+		gcond(cs[i], cs[i]->c);
+		b=gbind(cs[i]);
+		gcount(cs[i], cs[i]->c);
+		m=pmspec(pm, cs[i]->c, cs[i]->np, c);
 		grules(m);
+		if (b) {
+			bnd.i--;
+			nbnd-=cs[i]->np;
+		}
 	}
 
 	emit("\nelse\n");
+	gcount(cs[0], "_");
 	m=pmdef(pm, c);
 	grules(m);
 	emit("\nend");
@@ -302,48 +1416,62 @@ grules(struct PMat pm)
  * of a rewrite rule's environment.
  */
 static void
-gchkenv(char *x, struct Term *t, void *unused)
+gchkenv(char *x, Term t, void *unused)
 {
 	emit("chkbeg(\"%s\")\n", x);
 	emit(iskind(t)?"chkkind(":"chktype(");
 	gterm(t);
 	emit(")\nlocal %s = ", gname(C, x));
 	gccon(x, 0);
-	emit("\nlocal %s = { tk = tbox, tbox = { ", gname(T, x));
-	gcode(t);
-	emit(", %s } }\n", gname(C, x));
+	emit("\nlocal %s = ", gname(T, x));
+	gtbox(x, t);
+	emit("\n");
 	emit("chkend(\"%s\")\n", x);
 }
 
-/* genrules - Generate code to type check a rule set.
+/* internal grset - Generate code to type check a rule set.
  */
-void
-genrules(struct RSet *rs)
+static void
+grset(struct RSet *rs)
 {
 	int i, ar;
 	struct PMat pm;
 
+	if (gmode==Native) {
+		krules(rs);
+		return;
+	}
 	assert(rs->i>0);
 	ar=rs->s[0].l->nd+rs->s[0].l->np;
 	crs=rs;
+	if (glink) {
+		lbeg(rs->x);
+		lcur->ar=ar;
+	}
+	gabeg(0, rs);
 
 	if (ar==0) {
 		if (gmode==Check) {
 			emit("--[[ Type checking the definition of %s. ]]\n", rs->x);
+			emit("unit(function ()\n");
 			emit("chkbeg(\"definition of %s\")\n", rs->x);
 			emit("chk(");
 			gterm(rs->s[0].r);
-			emit(", %s.tbox[1])\n", gname(T, rs->x));
+			emit(", tybox(%s))\n", gname(T, rs->x));
 			emit("chkend(\"definition of %s\")\n", rs->x);
+			emit("end)\n");
 		}
 		emit("%s = ", gname(C, rs->x));
 		gcode(rs->s[0].r);
 		emit("\n\n");
+		gaend();
+		if (glink)
+			lend();
 		return;
 	}
 	if (gmode==Check) {
 		emit("--[[ Type checking rules of %s. ]]\n", rs->x);
-		emit("function check_rules()\nchkbeg(\"rules of %s\")\n", rs->x);
+		emit("unit(function ()\nchkbeg(\"rules of %s\")\n", rs->x);
 		for (i=0; i<rs->i; i++) {
 			emit("chkbeg(\"rule %d\")\n", i+1);
 			eiter(rs->s[i].e, gchkenv, 0);
@@ -353,10 +1481,10 @@ genrules(struct RSet *rs)
 			gterm(rs->s[i].r);
 			emit(", ty)\nend\nchkend(\"rule %d\")\n", i+1);
 		}
-		emit("chkend(\"rules of %s\")\nend\ncheck_rules()\n", rs->x);
+		emit("chkend(\"rules of %s\")\nend)\n", rs->x);
 	}
 	emit("--[[ Compiling rules of %s. ]]\n", rs->x);
-	emit("%s = { ck = clam, arity = %d, args = { }, clam =\n", gname(C, rs->x), ar);
+	emit("%s = { %d, %d,\n", gname(C, rs->x), CLam, ar);
 	emit("function (y1");
 	for (i=2; i<=ar; i++)
 		emit(", y%d", i);
@@ -364,59 +1492,76 @@ genrules(struct RSet *rs)
 	pm=pmnew(rs);
 	grules(pm);
 	emit("\nend }\n\n");
+	gaend();
+	if (glink)
+		lend();
 }
 
 /* ------------- Declaration compiling. ------------- */
 
-/* gendecl - Generate code to type check a declaration.
+/* internal gdecl - Generate code to type check a declaration.
  */
-void
-gendecl(char *x, struct Term *t)
+static void
+gdecl(char *x, Term t)
 {
+	if (gmode==Native) {
+		kdecl(x, t);
+		return;
+	}
+	if (glink)
+		lbeg(x);
+	gabeg(t, 0);
 	if (gmode==Check) {
 		emit("--[[ Type checking %s. ]]\n", x);
+		emit("unit(function ()\n");
 		emit("chkbeg(\"%s\")\n", x);
 		emit(iskind(t)?"chkkind(":"chktype(");
 		gterm(t);
 		emit(")\n");
 		emit("chkend(\"%s\")\n", x);
+		emit("end)\n");
 	}
 	emit("%s = ", gname(C, x));
 	gccon(x, 0);
-	emit("\n%s = { tk = tbox, tbox = { ", gname(T, x));
-	gcode(t);
-	emit(", %s } }\n\n", gname(C, x));
+	emit("\n%s = ", gname(T, x));
+	gtbox(x, t);
+	emit("\n\n");
+	gaend();
+	if (glink)
+		lend();
 }
 
 /* ------------- Term compiling. ------------- */
 
-/* MAXSDPTH - The maximum stack depth used in functions below,
- * these stacks are used to recurse on terms.
- */
-#define MAXSDPTH 128
-
 /* internal gccon - Generate the dynamic representation of
  * the constant x applied to y1, ..., yn.
  */
 static inline void
 gccon(char *x, int n)
 {
-	int i, sep;
+	int i;
 
-	emit("{ ck = ccon, ccon = \"%s\", args = {", x);
-	for (sep=0, i=1; i<=n; i++, sep=1)
-		emit(sep?", y%d":" y%d", i);
-	emit(" } }");
+	emit("{ %d, \"%s\"", CCon, x);
+	for (i=1; i<=n; i++)
+		emit(", y%d", i);
+	emit(" }");
 }
 
-/* MAXID - Maximum size of an identifier in the generated code.
+/* internal gtbox - Generate the box holding the type t of the
+ * variable x. The dynamic translation of the type is delayed
+ * in a thunk, the runtime evaluates it on first access.
  */
-#define MAXID 2*IDLEN+1
+static void
+gtbox(char *x, Term t)
+{
+	emit("{ %d, function () return ", TBox);
+	gcode(t);
+	emit(" end, %s }", gname(C, x));
+}
 
-/* internal gname - Generate the variable name to be emitted to
+/* internal gname - Return the variable name to be emitted to
  * access a variable. This name can be of two kinds, either a
  * 'code' name or a 'term' name.
- * Warning, this returns a static buffer.
  * Warning, this must be called _only_ when x is an atom,
  * calling it with a static string will cause undefined
  * behaviour.
@@ -424,181 +1569,529 @@ gccon(char *x, int n)
 static inline char *
 gname(enum NameKind nt, char *x)
 {
-	static char s[MAXID], *p, *q;
+	int n;
+	char *m=amangle(x, &n);
+	struct GAl *a;
 
-	q=x+aqual(x);
-	for (p=s; x<q; p++, x++)
-		*p=*x;
-	for (; *x; x++, p++) {
-		if (*x=='x' || *x=='\'') {
-			*p++='x';
-			*p=*x=='\''?'q':*x;
-			continue;
+	if (aqual(x)) {
+		lref(x);
+		if ((a=galias(nt, x)))
+			return a->s[nt];
+	}
+	return nt==C?m:m+n+1;
+}
+
+/* internal gid - Emit the variable name of the atom x, this
+ * is a plain copy of the name cached in the atom.
+ */
+static inline void
+gid(enum NameKind nt, char *x)
+{
+	int n;
+	char *m;
+	struct GAl *a;
+
+	if (aqual(x)) {
+		lref(x);
+		if ((a=galias(nt, x))) {
+			fwrite(a->s[nt], 1, a->l[nt], gout);
+			return;
 		}
-		*p=*x;
 	}
-	*p++='_';
-	*p++=nt==C?'c':'t';
-	*p=0;
-	return s;
+	m=amangle(x, &n);
+	fwrite(nt==C?m:m+n+1, 1, n, gout);
 }
 
-/* internal gcode - Emit an expression representing the dynamic
- * translation of a term in the lambda-Pi calculus.
+/* struct Job - Terms and patterns are compiled without
+ * recursion, the pieces of code that remain to be emitted are
+ * stored as jobs on an explicit stack. A job either emits a
+ * string, a variable name, or the static or dynamic translation
+ * of a term or a pattern.
+ */
+struct Job {
+	enum { JStr, JName, JCode, JTerm, JPCode, JPTerm } k;
+	enum NameKind nk;
+	union {
+		const char *s;
+		char *x;
+		Term t;
+		struct Pat *p;
+	} u;
+};
+
+/* internal jobs - The stack of jobs.
+ */
+static struct Stk jobs = STK(struct Job);
+
+/* internal jstr jname jterm jpat - Push jobs on the job stack,
+ * one job is pushed per emitted piece of code so they are
+ * macros.
+ */
+#define jstr(str)      spush(&jobs, (&(struct Job){ .k = JStr, .u.s = (str) }))
+#define jname(kn, id)  spush(&jobs, (&(struct Job){ .k = JName, .nk = (kn), .u.x = (id) }))
+#define jterm(kj, tm)  spush(&jobs, (&(struct Job){ .k = (kj), .u.t = (tm) }))
+#define jpat(kj, pt)   spush(&jobs, (&(struct Job){ .k = (kj), .u.p = (pt) }))
+
+/* internal jarg - Push the job emitting the dynamic translation
+ * of an argument, in lazy mode applications are delayed.
+ * Variables, the most common arguments, are pushed as names.
+ */
+static inline void
+jarg(Term t)
+{
+	if (tkind(t)==Var)
+		jname(C, tx(t));
+	else if (glazy && tkind(t)==App) {
+		jstr(" end }");
+		jterm(JCode, t);
+		jstr("{ 0, function () return "); /* CThk */
+	} else
+		jterm(JCode, t);
+}
+
+/* internal garity - Return the number of arguments of the
+ * application t if its head is a global symbol of the linked
+ * modules whose rules take exactly these arguments, they can
+ * then be passed by a direct call. Otherwise, 0 is returned.
+ */
+static int
+garity(Term t)
+{
+	struct LSym *s;
+	int n;
+
+	for (n=0; tkind(t)==App && n<=LMAXAPN; n++)
+		t=tl(t);
+	if (tkind(t)!=Var || !aqual(tx(t)) || !(s=lget(tx(t), 0)))
+		return 0;
+	return s->ar==n?n:0;
+}
+
+/* internal jcode - Emit the dynamic translation of a term, the
+ * sub terms are pushed as jobs except the last one which is
+ * emitted in place.
  */
 static void
-gcode(struct Term *t)
+jcode(Term t)
 {
-	char **lams;
-	int i, s;
+	Term u;
+	int s;
 
-/* tail: */
-	switch (t->typ) {
-	case Var:
-		emit("%s", gname(C, t->uvar));
-		break;
-	case Lam:
-		lams=xalloc(MAXSDPTH*sizeof *lams);
-		for (s=0; t->typ==Lam; s++) {
-			if (s>=MAXSDPTH) {
-				fprintf(stderr, "%s: Maximum recursion depth exceeded.\n"
-				                "\tThe maximum is %d.\n", __func__, MAXSDPTH);
-				exit(1); // FIXME
+	for (;;) {
+		switch (tkind(t)) {
+		case Var:
+			gid(C, tx(t));
+			return;
+		case Lam:
+			for (s=0, u=t; tkind(u)==Lam; s++)
+				u=tr(u);
+			emit("{ %d, %d, function (", CLam, s);
+			for (; tkind(t)==Lam; t=tr(t)) {
+				gid(C, tx(t));
+				if (tkind(tr(t))==Lam)
+					emit(", ");
 			}
-			lams[s]=t->ulam.x;
-			t=t->ulam.t;
+			emit(") return ");
+			jstr(" end }");
+			continue;
+		case Pi:
+			emit("{ %d, ", CPi);
+			jstr(" end }");
+			jterm(JCode, tr(t));
+			if (tx(t)) {
+				jstr(") return ");
+				jname(C, tx(t));
+				jstr(", function (");
+			} else
+				jstr(", function (dummy_c) return ");
+			t=tl(t);
+			continue;
+		case App:
+			if (glink && (s=garity(t))) {
+				emit("apn(");
+				jstr(")");
+				for (; tkind(t)==App; t=tl(t)) {
+					jarg(tr(t));
+					jstr(", ");
+				}
+				jname(C, tx(t));
+				return;
+			}
+			emit("ap(");
+			jstr(")");
+			jarg(tr(t));
+			jstr(", ");
+			t=tl(t);
+			continue;
+		case Type:
+			emit("{ %d }", CType);
+			return;
 		}
-		emit("{ ck = clam, arity = %d, args = { }, clam = function (", s);
-		for (i=0; i<s-1; i++)
-			emit("%s, ", gname(C, lams[i]));
-		emit("%s) return ", gname(C, lams[i]));
-		free(lams);
-		gcode(t);
-		emit(" end }");
-		break;
-	case Pi:
-		emit("{ ck = cpi, cpi = { ");
-		gcode(t->upi.ty);
-		if (t->upi.x)
-			emit(", function (%s) return ", gname(C, t->upi.x));
-		else
-			emit(", function (dummy_c) return ");
-		gcode(t->upi.t);
-		emit(" end } }");
-		break;
-	case App:
-		emit("ap(");
-		gcode(t->uapp.t1);
-		emit(", ");
-		gcode(t->uapp.t2);
-		emit(")");
-		break;
-	case Type:
-		emit("{ ck = ctype }");
-		break;
 	}
 }
 
-/* internal gterm - Emit an expression representing the static
- * translation of a term in the lambda-Pi calculus.
+/* internal jstat - Emit the static translation of a term, the
+ * sub terms are pushed as jobs except the last one which is
+ * emitted in place.
  */
 static void
-gterm(struct Term *t)
-{
-/* tail: */
-	switch (t->typ) {
-	case Var:
-		emit("%s", gname(T, t->uvar));
-		break;
-	case Lam:
-		emit("{ tk = tlam, tlam = { nil, ");
-		emit("function (%s, ", gname(T, t->ulam.x));
-		emit("%s) return ", gname(C, t->ulam.x));
-		gterm(t->ulam.t);
-		emit(" end } }");
-		break;
-	case Pi:
-		emit("{ tk = tpi; tpi = { ");
-		gterm(t->upi.ty);
-		emit(", ");
-		gcode(t->upi.ty);
-		if (t->upi.x) {
-			emit(", function (%s, ", gname(T, t->upi.x));
-			emit("%s) return ", gname(C, t->upi.x));
-		} else
-			emit(", function (dummy_t, dummy_c) return ");
-		gterm(t->upi.t);
-		emit(" end } }");
-		break;
-	case App:
-		emit("{ tk = tapp, tapp = { ");
-		gterm(t->uapp.t1);
-		emit(", ");
-		gterm(t->uapp.t2);
-		emit(", ");
-		gcode(t->uapp.t2);
-		emit(" } }");
-		break;
-	case Type:
-		emit("{ tk = ttype }");
-		break;
+jstat(Term t)
+{
+	for (;;) {
+		switch (tkind(t)) {
+		case Var:
+			gid(T, tx(t));
+			return;
+		case Lam:
+			emit("{ %d, ", TLam);
+			emit("function (");
+			gid(T, tx(t));
+			emit(", ");
+			gid(C, tx(t));
+			emit(") return ");
+			jstr(" end }");
+			t=tr(t);
+			continue;
+		case Pi:
+			emit("{ %d, ", TPi);
+			jstr(" end }");
+			jterm(JTerm, tr(t));
+			if (tx(t)) {
+				jstr(") return ");
+				jname(C, tx(t));
+				jstr(", ");
+				jname(T, tx(t));
+				jstr(", function (");
+			} else
+				jstr(", function (dummy_t, dummy_c) return ");
+			jterm(JCode, tl(t));
+			jstr(", ");
+			t=tl(t);
+			continue;
+		case App:
+			emit("{ %d, ", TApp);
+			jstr(" }");
+			jterm(JCode, tr(t));
+			jstr(", ");
+			jterm(JTerm, tr(t));
+			jstr(", ");
+			t=tl(t);
+			continue;
+		case Type:
+			emit("{ %d }", TType);
+			return;
+		}
 	}
 }
 
-/* internal gpcode - Emit the expression representing the dynamic
- * translation of a pattern in the lambda-Pi calculus.
+/* internal jpcode - Emit the dynamic translation of a pattern,
+ * the sub patterns and dot patterns are pushed as jobs.
  */
 static void
-gpcode(struct Pat *p)
+jpcode(struct Pat *p)
 {
 	int i;
 
 	if (p->np<0) {
-		emit("%s", gname(C, p->c));
+		gid(C, p->c);
 		return;
 	}
 	for (i=0; i<p->nd+p->np; i++)
 		emit("ap(");
-	emit("%s", gname(C, p->c));
-	for (i=0; i<p->nd; i++) {
-		emit(", ");
-		gcode(p->ds[i]);
-		emit(")");
+	gid(C, p->c);
+	for (i=p->np-1; i>=0; i--) {
+		jstr(")");
+		jpat(JPCode, p->ps[i]);
+		jstr(", ");
 	}
-	for (i=0; i<p->np; i++) {
-		emit(", ");
-		gpcode(p->ps[i]);
-		emit(")");
+	for (i=p->nd-1; i>=0; i--) {
+		jstr(")");
+		jterm(JCode, p->ds[i]);
+		jstr(", ");
 	}
 }
 
-/* internal gpterm - Emit the expression representing the static
- * translation of a pattern in the lambda-Pi calculus.
+/* internal jpterm - Emit the static translation of a pattern,
+ * the sub patterns and dot patterns are pushed as jobs.
  */
 static void
-gpterm(struct Pat *p)
+jpterm(struct Pat *p)
 {
 	int i;
 
 	if (p->np<0) {
-		emit("%s", gname(T, p->c));
+		gid(T, p->c);
 		return;
 	}
 	for (i=0; i<p->nd+p->np; i++)
-		emit("{ tk = tapp, tapp = { ");
-	emit("%s", gname(T, p->c));
-	for (i=0; i<p->nd; i++) {
-		emit(", ");
-		gterm(p->ds[i]);
-		emit(", ");
-		gcode(p->ds[i]);
-		emit(" } }");
+		emit("{ %d, ", TApp);
+	gid(T, p->c);
+	for (i=p->np-1; i>=0; i--) {
+		jstr(" }");
+		jpat(JPCode, p->ps[i]);
+		jstr(", ");
+		jpat(JPTerm, p->ps[i]);
+		jstr(", ");
 	}
-	for (i=0; i<p->np; i++) {
-		emit(", ");
-		gpterm(p->ps[i]);
-		emit(", ");
-		gpcode(p->ps[i]);
-		emit(" } }");
+	for (i=p->nd-1; i>=0; i--) {
+		jstr(" }");
+		jterm(JCode, p->ds[i]);
+		jstr(", ");
+		jterm(JTerm, p->ds[i]);
+		jstr(", ");
+	}
+}
+
+/* internal grun - Run all the jobs pushed on the job stack
+ * since its size was b.
+ */
+static void
+grun(size_t b)
+{
+	struct Job j;
+
+	while (jobs.i>b) {
+		spop(&jobs, &j);
+		switch (j.k) {
+		case JStr:
+			emit("%s", j.u.s);
+			break;
+		case JName:
+			gid(j.nk, j.u.x);
+			break;
+		case JCode:
+			jcode(j.u.t);
+			break;
+		case JTerm:
+			jstat(j.u.t);
+			break;
+		case JPCode:
+			jpcode(j.u.p);
+			break;
+		case JPTerm:
+			jpterm(j.u.p);
+			break;
+		}
+	}
+}
+
+/* internal gcode - Emit an expression representing the dynamic
+ * translation of a term in the lambda-Pi calculus.
+ */
+static void
+gcode(Term t)
+{
+	size_t b=jobs.i;
+
+	jterm(JCode, t);
+	grun(b);
+}
+
+/* internal gterm - Emit an expression representing the static
+ * translation of a term in the lambda-Pi calculus.
+ */
+static void
+gterm(Term t)
+{
+	size_t b=jobs.i;
+
+	jterm(JTerm, t);
+	grun(b);
+}
+
+/* internal gpterm - Emit the expression representing the static
+ * translation of a pattern in the lambda-Pi calculus.
+ */
+static void
+gpterm(struct Pat *p)
+{
+	size_t b=jobs.i;
+
+	jpat(JPTerm, p);
+	grun(b);
+}
+
+/* ------------- Pipelined generation. ------------- */
+
+/* QLEN - Size of the queue of generation jobs.
+ */
+#define QLEN 64
+
+/* struct GJob - A generation job, the memory pool holding the
+ * terms of the job is handed over with it.
+ */
+struct GJob {
+	enum { GMod, GDecl, GRules, GEnd, GQuit } k;
+	struct Pool *p;
+	FILE *f;
+	int fl;
+	char *m, *x;
+	Term t;
+	struct RSet rs;
+};
+
+/* internal q qhd qn - The bounded queue of jobs, qhd is the
+ * index of the first job and qn the number of jobs.
+ */
+static struct GJob q[QLEN];
+static int qhd, qn;
+static pthread_mutex_t qmtx=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qfull=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t qempty=PTHREAD_COND_INITIALIZER;
+static pthread_t gthr;
+static int grunning;
+
+/* internal gloop - Main loop of the generation thread.
+ */
+static void *
+gloop(void *unused)
+{
+	struct GJob *j;
+
+	for (;;) {
+		pthread_mutex_lock(&qmtx);
+		while (qn==0)
+			pthread_cond_wait(&qempty, &qmtx);
+		j=&q[qhd];
+		pthread_mutex_unlock(&qmtx);
+
+		padopt(j->p);
+		switch (j->k) {
+		case GMod:
+			gout=j->f;
+			gfl=j->fl;
+			gmod(j->m);
+			free(j->m);
+			break;
+		case GDecl:
+			gdecl(j->x, j->t);
+			break;
+		case GRules:
+			grset(&j->rs);
+			break;
+		case GEnd:
+			gend();
+			break;
+		case GQuit:
+			padopt(0);
+			fflush(gout);
+			return 0;
+		}
+
+		pthread_mutex_lock(&qmtx);
+		qhd=(qhd+1)%QLEN;
+		qn--;
+		pthread_cond_signal(&qfull);
+		pthread_mutex_unlock(&qmtx);
+	}
+}
+
+/* internal gpush - Push a job on the queue, the current memory
+ * pool is detached and given to the job. The generation thread
+ * is started on the first call.
+ */
+static void
+gpush(struct GJob *j)
+{
+	if (!grunning) {
+		if (pthread_create(&gthr, 0, gloop, 0)) {
+			fprintf(stderr, "%s: Cannot create thread.\n", __func__);
+			exit(1); // FIXME
+		}
+		grunning=1;
+	}
+	j->p=pdetach();
+	pthread_mutex_lock(&qmtx);
+	while (qn==QLEN)
+		pthread_cond_wait(&qfull, &qmtx);
+	q[(qhd+qn)%QLEN]=*j;
+	qn++;
+	pthread_cond_signal(&qempty);
+	pthread_mutex_unlock(&qmtx);
+}
+
+/* genwait - Wait until all the queued jobs are processed and
+ * stop the generation thread.
+ */
+void
+genwait(void)
+{
+	struct GJob j;
+
+	if (!grunning)
+		return;
+	j.k=GQuit;
+	gpush(&j);
+	pthread_join(gthr, 0);
+	grunning=0;
+}
+
+/* genmod - Generate the code to prepend to a compiled module,
+ * it initializes the current module table and its output is
+ * printed in gfile.
+ */
+void
+genmod(void)
+{
+	struct GJob j;
+
+	if (!gpipe) {
+		gout=gfile;
+		gfl=gflush;
+		gmod(mget());
+		return;
+	}
+	j.k=GMod;
+	j.f=gfile;
+	j.fl=gflush;
+	j.m=strcpy(xalloc(strlen(mget())+1), mget());
+	gpush(&j);
+}
+
+/* genend - Generate the code to append to a compiled module.
+ */
+void
+genend(void)
+{
+	struct GJob j;
+
+	if (!gpipe) {
+		gend();
+		return;
+	}
+	j.k=GEnd;
+	gpush(&j);
+}
+
+/* genrules - Generate code to type check a rule set.
+ */
+void
+genrules(struct RSet *rs)
+{
+	struct GJob j;
+
+	if (!gpipe) {
+		grset(rs);
+		return;
+	}
+	j.k=GRules;
+	j.rs=*rs;
+	gpush(&j);
+}
+
+/* gendecl - Generate code to type check a declaration.
+ */
+void
+gendecl(char *x, Term t)
+{
+	struct GJob j;
+
+	if (!gpipe) {
+		gdecl(x, t);
+		return;
 	}
+	j.k=GDecl;
+	j.x=x;
+	j.t=t;
+	gpush(&j);
 }
@@ -0,0 +1,735 @@
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dk.h"
+#include "lib/avl.h"
+
+/* This module is a native type checker for the lambda-Pi
+ * modulo, it is used instead of the Lua runtime when the
+ * generation mode is Native. Terms are evaluated to values
+ * by an environment machine (normalization by evaluation)
+ * and values are compared for conversion using de Bruijn
+ * levels to build fresh variables.
+ */
+
+/* ------------- Memory pools. ------------- */
+
+/* internal perm tmp cur - Values built while checking one
+ * declaration are stored in the tmp pool which is reset once
+ * the declaration is checked; objects stored in the global
+ * signature are stored in the perm pool. Allocations are done
+ * in the cur pool.
+ */
+static struct Pool *perm, *tmp, *cur;
+
+/* internal kalloc - Allocate an object in the current pool.
+ */
+static void *
+kalloc(size_t s)
+{
+	return palloc(cur, s);
+}
+
+/* ------------- Values. ------------- */
+
+/* struct KEnv - Environments bind variables to values, when
+ * type checking, the type of the variable is also stored.
+ */
+struct KEnv {
+	char *x;
+	struct Val *v, *ty;
+	struct KEnv *n;
+};
+
+/* struct Val - Values are the result of the evaluation of
+ * terms. Lambdas and products are closures. Constants and
+ * fresh variables (with a null c field and a level l) are
+ * applied to n arguments, the spine is stored as a linked
+ * list: f is the value applied to n-1 arguments and a is the
+ * last argument. Partially applied symbols defined by rewrite
+ * rules use the same representation.
+ */
+struct Val {
+	enum { VLam, VPi, VCon, VRul, VType, VKind } k;
+	int n;
+	union {
+		struct {
+			char *x;
+			Term t;
+			struct KEnv *e;
+			struct Val *ty;
+		} clo;
+		struct {
+			char *c;
+			int l;
+			struct Glob *g;
+			struct Val *f, *a;
+		} app;
+	} u;
+};
+
+#define uclo u.clo
+#define uapp u.app
+
+static struct Val vtype = { VType }, vkind = { VKind };
+
+/* struct KRule - A rewrite rule stored in the signature.
+ */
+struct KRule {
+	struct Pat *l;
+	Term r;
+};
+
+/* struct Glob - An entry of the global signature. The type
+ * ty is evaluated on demand and stored in tyv. A symbol
+ * defined by rewrite rules has a positive arity ar and the
+ * nr rules in rs, its value without arguments is rv. A symbol
+ * defined without arguments has its value in def.
+ */
+struct Glob {
+	char *x;
+	Term ty;
+	struct Val *tyv, *c, *rv, *def;
+	int ar, nr;
+	struct KRule *rs;
+};
+
+/* internal sig - The global signature.
+ */
+static struct Tree *sig;
+
+static struct Val *eval(Term, struct KEnv *);
+static struct Val *apply(struct Val *, struct Val *);
+
+/* internal kerr - Display an error message and exit.
+ */
+static void
+kerr(const char *fmt, ...)
+{
+	va_list ap;
+
+	fflush(stdout);
+	va_start(ap, fmt);
+	fputs("Type checking failed: ", stderr);
+	vfprintf(stderr, fmt, ap);
+	fputs("\n", stderr);
+	va_end(ap);
+	exit(1);
+}
+
+/* internal econs - Extend an environment.
+ */
+static struct KEnv *
+econs(char *x, struct Val *v, struct Val *ty, struct KEnv *e)
+{
+	struct KEnv *pe;
+
+	if (!x)
+		return e;
+	pe=kalloc(sizeof *pe);
+	pe->x=x;
+	pe->v=v;
+	pe->ty=ty;
+	pe->n=e;
+	return pe;
+}
+
+/* internal mkcon - Build a constant (or a fresh variable if c
+ * is null) applied to no argument.
+ */
+static struct Val *
+mkcon(char *c, int l)
+{
+	struct Val *v=kalloc(sizeof *v);
+
+	v->k=VCon;
+	v->n=0;
+	v->uapp.c=c;
+	v->uapp.l=l;
+	v->uapp.g=0;
+	v->uapp.f=v->uapp.a=0;
+	return v;
+}
+
+/* internal push - Apply a constant or a partially applied
+ * symbol to one more argument.
+ */
+static struct Val *
+push(struct Val *f, struct Val *a)
+{
+	struct Val *v=kalloc(sizeof *v);
+
+	*v=*f;
+	v->n=f->n+1;
+	v->uapp.f=f;
+	v->uapp.a=a;
+	return v;
+}
+
+/* internal spine - Store the n arguments of an application
+ * in the array as.
+ */
+static void
+spine(struct Val *v, struct Val **as)
+{
+	for (; v->n>0; v=v->uapp.f)
+		as[v->n-1]=v->uapp.a;
+}
+
+/* ------------- Global signature. ------------- */
+
+/* internal globcmp - Compare two signature entries, atoms
+ * are compared by address.
+ */
+static int
+globcmp(void *a, void *b)
+{
+	char *x=((struct Glob *)a)->x, *y=((struct Glob *)b)->x;
+	return x<y ? -1 : x>y;
+}
+
+/* internal gget - Find a symbol in the signature, if it is
+ * not found, an error is signaled.
+ */
+static struct Glob *
+gget(char *x)
+{
+	struct Glob *g, k = { x };
+
+	if (!(g=avlget(&k, sig)))
+		kerr("Unknown symbol %s.", x);
+	return g;
+}
+
+/* internal gval - Return the current value of a symbol.
+ */
+static struct Val *
+gval(struct Glob *g)
+{
+	if (g->def)
+		return g->def;
+	if (g->nr)
+		return g->rv;
+	return g->c;
+}
+
+/* internal gtype - Return the type of a symbol, it is
+ * evaluated on first use.
+ */
+static struct Val *
+gtype(struct Glob *g)
+{
+	struct Pool *p=cur;
+
+	if (!g->tyv) {
+		cur=perm;
+		g->tyv=eval(g->ty, 0);
+		cur=p;
+	}
+	return g->tyv;
+}
+
+/* internal tcopy pcopy - Copy a term in the permanent arena
+ * or a pattern in the current pool, this is used to store terms
+ * in the signature. Children are copied first since allocating
+ * a node can move the arena.
+ */
+static Term
+tcopy(Term t)
+{
+	Term u, l=0, r=0;
+
+	if (t&TPERM)
+		return t;
+	switch (tkind(t)) {
+	case App:
+	case Pi:
+		l=tcopy(tl(t));
+		/* fall through */
+	case Lam:
+		r=tcopy(tr(t));
+		break;
+	default:
+		break;
+	}
+	u=tnew(&tperm, tkind(t))|TPERM;
+	tx(u)=tx(t);
+	tl(u)=l;
+	tr(u)=r;
+	return u;
+}
+
+static struct Pat *
+pcopy(struct Pat *p)
+{
+	struct Pat *q=kalloc(sizeof *q);
+	int i;
+
+	*q=*p;
+	q->up=0;
+	if (p->np<0)
+		return q;
+	q->ds=kalloc(p->nd*sizeof *q->ds);
+	for (i=0; i<p->nd; i++)
+		q->ds[i]=tcopy(p->ds[i]);
+	q->ps=kalloc(p->np*sizeof *q->ps);
+	for (i=0; i<p->np; i++) {
+		q->ps[i]=pcopy(p->ps[i]);
+		q->ps[i]->up=q;
+	}
+	return q;
+}
+
+/* ------------- Evaluation. ------------- */
+
+/* internal match - Match a value against a pattern, pattern
+ * variables are bound in the environment pointed by pe. If the
+ * matching fails, 0 is returned.
+ */
+static int
+match(struct Pat *p, struct Val *v, struct KEnv **pe)
+{
+	struct Val **as;
+	int i;
+
+	if (p->np<0) {
+		*pe=econs(p->c, v, 0, *pe);
+		return 1;
+	}
+	if (v->k!=VCon || v->uapp.c!=p->c || v->n!=p->nd+p->np)
+		return 0;
+	as=kalloc(v->n*sizeof *as);
+	spine(v, as);
+	for (i=0; i<p->np; i++)
+		if (!match(p->ps[i], as[p->nd+i], pe))
+			return 0;
+	return 1;
+}
+
+/* internal fire - Rewrite a fully applied symbol using the
+ * first matching rule. If no rule matches, the symbol is
+ * turned into a constant.
+ */
+static struct Val *
+fire(struct Val *v)
+{
+	struct Glob *g=v->uapp.g;
+	struct Val **as;
+	struct KEnv *e;
+	int r, i;
+
+	as=kalloc(g->ar*sizeof *as);
+	spine(v, as);
+	for (r=0; r<g->nr; r++) {
+		struct Pat *l=g->rs[r].l;
+		e=0;
+		for (i=0; i<l->np; i++)
+			if (!match(l->ps[i], as[l->nd+i], &e))
+				break;
+		if (i==l->np)
+			return eval(g->rs[r].r, e);
+	}
+	for (v=g->c, i=0; i<g->ar; i++)
+		v=push(v, as[i]);
+	return v;
+}
+
+/* internal apply - Apply a value to another.
+ */
+static struct Val *
+apply(struct Val *f, struct Val *a)
+{
+	switch (f->k) {
+	case VLam:
+		return eval(f->uclo.t, econs(f->uclo.x, a, 0, f->uclo.e));
+	case VCon:
+		return push(f, a);
+	case VRul:
+		f=push(f, a);
+		return f->n==f->uapp.g->ar ? fire(f) : f;
+	default:
+		kerr("Only functions and constants can be applied.");
+		return 0;
+	}
+}
+
+/* internal cod - Instantiate the codomain of a product.
+ */
+static struct Val *
+cod(struct Val *p, struct Val *v)
+{
+	assert(p->k==VPi);
+	return eval(p->uclo.t, econs(p->uclo.x, v, 0, p->uclo.e));
+}
+
+/* internal eval - Evaluate a term in an environment.
+ */
+static struct Val *
+eval(Term t, struct KEnv *e)
+{
+	struct Val *v;
+
+	switch (tkind(t)) {
+	case Var:
+		for (; e; e=e->n)
+			if (e->x==tx(t))
+				return e->v;
+		return gval(gget(tx(t)));
+	case Lam:
+	case Pi:
+		v=kalloc(sizeof *v);
+		v->n=0;
+		if (tkind(t)==Lam) {
+			v->k=VLam;
+			v->uclo.x=tx(t);
+			v->uclo.t=tr(t);
+			v->uclo.ty=0;
+		} else {
+			v->k=VPi;
+			v->uclo.x=tx(t);
+			v->uclo.t=tr(t);
+			v->uclo.ty=eval(tl(t), e);
+		}
+		v->uclo.e=e;
+		return v;
+	case App:
+		v=eval(tl(t), e);
+		return apply(v, eval(tr(t), e));
+	case Type:
+		return &vtype;
+	}
+	assert(!"unreachable");
+	return 0;
+}
+
+/* ------------- Conversion. ------------- */
+
+/* internal fresh - Return the fresh variable of level n.
+ */
+static struct Val *
+fresh(int n)
+{
+	return mkcon(0, n);
+}
+
+/* internal vprint - Print a value, this is used in error
+ * messages.
+ */
+static void
+vprint(int n, struct Val *v)
+{
+	struct Val **as;
+	int i;
+
+	switch (v->k) {
+	case VLam:
+	case VRul:
+		fprintf(stderr, "(\\%d. ", n);
+		vprint(n+1, apply(v, fresh(n)));
+		fputs(")", stderr);
+		break;
+	case VPi:
+		fprintf(stderr, "(Pi %d:", n);
+		vprint(n, v->uclo.ty);
+		fputs(". ", stderr);
+		vprint(n+1, cod(v, fresh(n)));
+		fputs(")", stderr);
+		break;
+	case VCon:
+		if (v->uapp.c)
+			fprintf(stderr, "(%s", v->uapp.c);
+		else
+			fprintf(stderr, "(var%d", v->uapp.l);
+		as=kalloc(v->n*sizeof *as);
+		spine(v, as);
+		for (i=0; i<v->n; i++) {
+			fputs(" ", stderr);
+			vprint(n, as[i]);
+		}
+		fputs(")", stderr);
+		break;
+	case VType:
+		fputs("Type", stderr);
+		break;
+	case VKind:
+		fputs("Kind", stderr);
+		break;
+	}
+}
+
+/* internal isfun - Check if a value is a function.
+ */
+static inline int
+isfun(struct Val *v)
+{
+	return v->k==VLam || v->k==VRul;
+}
+
+/* internal conv - Check if two values are convertible, n is
+ * the level of the next fresh variable. Physically equal
+ * values are convertible.
+ */
+static int
+conv(int n, struct Val *a, struct Val *b)
+{
+	struct Val *v;
+
+	if (a==b)
+		return 1;
+	if (a->k==VPi && b->k==VPi) {
+		v=fresh(n);
+		return conv(n, a->uclo.ty, b->uclo.ty)
+		    && conv(n+1, cod(a, v), cod(b, v));
+	}
+	if (isfun(a) && isfun(b)) {
+		v=fresh(n);
+		return conv(n+1, apply(a, v), apply(b, v));
+	}
+	if (a->k==VCon && b->k==VCon && a->n==b->n
+	&& a->uapp.c==b->uapp.c && a->uapp.l==b->uapp.l) {
+		for (; a!=b && a->n>0; a=a->uapp.f, b=b->uapp.f)
+			if (!conv(n, a->uapp.a, b->uapp.a))
+				return 0;
+		return 1;
+	}
+	if (a->k==b->k && (a->k==VType || a->k==VKind))
+		return 1;
+	fputs("Terms are not convertible:\n    ", stderr);
+	vprint(n, a);
+	fputs("\n    ", stderr);
+	vprint(n, b);
+	fputs("\n", stderr);
+	return 0;
+}
+
+/* ------------- Type checking. ------------- */
+
+static void check(int, Term, struct Val *, struct KEnv *);
+
+/* internal synth - Synthesize the type of a term in the
+ * typing environment e.
+ */
+static struct Val *
+synth(int n, Term t, struct KEnv *e)
+{
+	struct Val *c;
+
+	switch (tkind(t)) {
+	case Var:
+		for (; e; e=e->n)
+			if (e->x==tx(t))
+				return e->ty;
+		return gtype(gget(tx(t)));
+	case Type:
+		return &vkind;
+	case App:
+		c=synth(n, tl(t), e);
+		if (c->k!=VPi)
+			kerr("Product expected in application.");
+		check(n, tr(t), c->uclo.ty, e);
+		return cod(c, eval(tr(t), e));
+	default:
+		kerr("Type synthesis failed.");
+		return 0;
+	}
+}
+
+/* internal check - Check a term against a type in the typing
+ * environment e.
+ */
+static void
+check(int n, Term t, struct Val *c, struct KEnv *e)
+{
+	struct Val *v;
+
+	switch (tkind(t)) {
+	case Lam:
+		if (c->k!=VPi)
+			kerr("Product expected.");
+		v=fresh(n);
+		check(n+1, tr(t), cod(c, v), econs(tx(t), v, c->uclo.ty, e));
+		break;
+	case Pi:
+		check(n, tl(t), &vtype, e);
+		v=fresh(n);
+		check(n+1, tr(t), c, econs(tx(t), v, eval(tl(t), e), e));
+		break;
+	default:
+		if (!conv(n, synth(n, t, e), c))
+			kerr("Terms are not convertible.");
+		break;
+	}
+}
+
+/* internal ptterm - Build the term corresponding to a
+ * pattern, patterns are type checked as terms.
+ */
+static Term
+ptterm(struct Pat *p)
+{
+	Term t;
+	int i;
+
+	t=mkvar(p->c);
+	if (p->np<0)
+		return t;
+	for (i=0; i<p->nd; i++)
+		t=mkapp(t, p->ds[i]);
+	for (i=0; i<p->np; i++)
+		t=mkapp(t, ptterm(p->ps[i]));
+	return t;
+}
+
+/* ------------- Check reporting. ------------- */
+
+/* internal indent - Indentation level of progress messages,
+ * they are formatted like the messages of the Lua runtime.
+ */
+static int indent;
+
+static void
+kbeg(const char *fmt, ...)
+{
+	va_list ap;
+
+	printf("%*sChecking ", 2*indent++, "");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf(".\n");
+}
+
+static void
+kend(const char *fmt, ...)
+{
+	va_list ap;
+
+	printf("%*sDone checking \033[32m", 2*--indent, "");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\033[m.\n");
+}
+
+/* ------------- Declarations and rules. ------------- */
+
+/* internal ksort - Check that a term is a type or a kind.
+ */
+static void
+ksort(Term t, struct KEnv *e)
+{
+	check(0, t, iskind(t)?&vkind:&vtype, e);
+}
+
+/* kdecl - Type check a declaration and add it to the global
+ * signature.
+ */
+void
+kdecl(char *x, Term t)
+{
+	struct Glob *g;
+
+	if (!sig) {
+		sig=avlnew(globcmp, 0);
+		perm=pnew();
+		cur=tmp=pnew();
+	}
+	kbeg("%s", x);
+	ksort(t, 0);
+	kend("%s", x);
+	cur=perm;
+	g=kalloc(sizeof *g);
+	g->x=x;
+	g->ty=tcopy(t);
+	g->tyv=g->rv=g->def=0;
+	g->c=mkcon(x, -1);
+	g->ar=g->nr=0;
+	g->rs=0;
+	cur=tmp;
+	avlins(g, sig);
+	preset(tmp);
+}
+
+/* internal kenv - Type check one binding of a rewrite rule's
+ * environment and add it to the typing environment.
+ */
+static void
+kenv(char *x, Term t, void *pe)
+{
+	struct KEnv **e=pe;
+
+	kbeg("%s", x);
+	ksort(t, *e);
+	*e=econs(x, mkcon(x, -1), eval(t, *e), *e);
+	kend("%s", x);
+}
+
+/* krules - Type check a rule set and install it in the
+ * global signature.
+ */
+void
+krules(struct RSet *rs)
+{
+	struct Glob *g;
+	struct KEnv *e;
+	struct KRule *r;
+	struct Val *ty;
+	int i, ar;
+
+	assert(rs->i>0);
+	g=gget(rs->x);
+	ar=rs->s[0].l->nd+rs->s[0].l->np;
+
+	if (ar==0) {
+		kbeg("definition of %s", rs->x);
+		check(0, rs->s[0].r, gtype(g), 0);
+		kend("definition of %s", rs->x);
+		cur=perm;
+		g->def=eval(tcopy(rs->s[0].r), 0);
+		cur=tmp;
+		preset(tmp);
+		return;
+	}
+	kbeg("rules of %s", rs->x);
+	for (i=0; i<rs->i; i++) {
+		kbeg("rule %d", i+1);
+		e=0;
+		eiter(rs->s[i].e, kenv, &e);
+		ty=synth(0, ptterm(rs->s[i].l), e);
+		check(0, rs->s[i].r, ty, e);
+		kend("rule %d", i+1);
+	}
+	kend("rules of %s", rs->x);
+	cur=perm;
+	r=kalloc(rs->i*sizeof *r);
+	for (i=0; i<rs->i; i++) {
+		r[i].l=pcopy(rs->s[i].l);
+		r[i].r=tcopy(rs->s[i].r);
+	}
+	g->rs=r;
+	g->nr=rs->i;
+	g->ar=ar;
+	g->rv=mkcon(rs->x, -1);
+	g->rv->k=VRul;
+	g->rv->uapp.g=g;
+	cur=tmp;
+	preset(tmp);
+}
+
+/* kdeinit - Free the global signature.
+ */
+void
+kdeinit(void)
+{
+	if (sig)
+		avlfree(sig);
+	sig=0;
+	if (perm) {
+		pfree(tmp);
+		pfree(perm);
+	}
+	perm=tmp=cur=0;
+	tfree(&tperm);
+}
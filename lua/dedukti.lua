@@ -3,77 +3,142 @@
 -- Terms can be of 6 kinds, either a lambda, a product, an
 -- application, type, or a box.
 --
--- In a term object, two fields must be present, 'tk',
--- indicating the kind of the term, and a field with
--- the name of the kind.
+-- Code can be of 7 kinds, either a lambda, a product, a
+-- rule, a constant, a fresh variable, type, or kind.
+--
+-- Both terms and code are flat arrays, the first slot holds
+-- the kind as a number and the other slots its fields:
+--
+--   { tlam, function (x_t, x_c) ... end }
+--   { tlet, t, c, function (x_t, x_c) ... end }
+--   { tpi, ty_t, ty_c, function (x_t, x_c) ... end }
+--   { tapp, t1, t2, c2 }
+--   { ttype }
+--   { tbox, ty, c }
+--
+--   { clam, arity, function (...) ... end, args ... }
+--   { cpi, dom, function (x_c) ... end }
+--   { ccon, "name", args ... }
+--   { cvar, level, args ... }
+--   { ctype }
+--   { ckind }
+--
+-- When dkparse is run with -n, some arguments are passed as
+-- thunks { cthk, function () ... end }, fc forces them and
+-- overwrites the thunk with its value.
+--
+-- The code generator emits these numbers directly, they
+-- must be kept in sync with gen.c.
 
--- Code can be of 6 kinds, either a lambda, a product, a
--- rule, a constant, type, or kind.
+cthk, clam, cpi, ccon, cvar, ctype, ckind = -- Possible code kinds
+  0, 1, 2, 3, 4, 5, 6;
 
-tlam, tlet, tpi, tapp, ttype, tbox = -- Possible tk
-  'tlam', 'tlet', 'tpi', 'tapp', 'ttype', 'tbox';
+tlam, tlet, tpi, tapp, ttype, tbox = -- Possible term kinds
+  7, 8, 9, 10, 11, 12;
 
-clam, cpi, ccon, ctype, ckind =      -- Possible ck
-  'clam', 'cpi', 'ccon', 'ctype', 'ckind';
+-- Fresh variables are identified by their level, they are
+-- allocated once per level.
+local vars = {};
 
 function var(n)
-  return { ck = ccon, ccon = "var" .. n, args = {} };
+  local v = vars[n];
+  if not v then
+    v = { cvar, n };
+    vars[n] = v;
+  end
+  return v;
 end
 
 function box(ty, t)
-  return { tk = tbox, tbox = { ty, t } };
+  return { tbox, ty, t };
 end
 
-local function push(c, v)
-  local a = {};
-  for i=1,#c.args do
-    a[i] = c.args[i];
+-- The type stored in the box of a declaration can be a
+-- thunk, it is evaluated on first access.
+function tybox(t)
+  local ty = t[2];
+  if type(ty) == "function" then
+    ty = ty();
+    t[2] = ty;
   end
-  table.insert(a, v);
-  if c.ck == clam then
-    return { ck = clam, clam = c.clam, arity = c.arity, args = a };
-  else
-    return { ck = ccon, ccon = c.ccon, args = a };
+  return ty;
+end
+
+function fc(c)
+  if c[1] == cthk then
+    local v = fc(c[2]());
+    c[2] = nil;
+    for i=1,#v do
+      c[i] = v[i];
+    end
   end
+  return c;
+end
+
+local function push(c, v)
+  local a = { unpack(c) };
+  a[#a+1] = v;
+  return a;
 end
 
 function ap(a, b)
-  assert(a.ck and b.ck);
-  if a.ck == clam then      -- Apply a rewrite rule/lambda.
+  local k = a[1];
+  if k == cthk then
+    k = fc(a)[1];
+  end
+  if k == clam then      -- Apply a rewrite rule/lambda.
     local c = push(a, b);
-    if #c.args == c.arity then
-      return c.clam(unpack(c.args));
+    if #c - 3 == c[2] then
+      return c[3](unpack(c, 4));
     else
       return c;
     end
-  elseif a.ck == ccon then  -- Apply a constant.
+  elseif k == ccon or k == cvar then  -- Apply a constant.
     return push(a, b);
   end
 end
 
-function conv(n, a, b)
-  assert(a.ck and b.ck);
-  local v = var(n);
-  if a.ck == cpi and b.ck == cpi then
-    return conv(n, a.cpi[1], b.cpi[1])
-       and conv(n+1, a.cpi[2](v), b.cpi[2](v));
-  elseif a.ck == clam and b.ck == clam then
+-- Apply a global symbol to all the arguments of its rules, this
+-- is emitted by linked bundles. When its rules are defined, they
+-- are called directly.
+function apn(a, ...)
+  if a[1] == clam and a[2] == select("#", ...) and #a == 3 then
+    return a[3](...);
+  end
+  for i = 1, select("#", ...) do
+    a = ap(a, (select(i, ...)));
+  end
+  return a;
+end
+
+-- Results of conversion checks are cached for pairs of
+-- objects, by identity, during one top-level check. Keys
+-- are weak so the cache does not keep terms alive.
+local weak = { __mode = "k" };
+local convc, convh, convm = setmetatable({}, weak), 0, 0;
+
+local function convs(n, a, b)
+  local k = a[1];
+  if k == cpi and b[1] == cpi then
+    local v = var(n);
+    return conv(n, a[2], b[2])
+       and conv(n+1, a[3](v), b[3](v));
+  elseif k == clam and b[1] == clam then
+    local v = var(n);
     return conv(n+1, ap(a, v), ap(b, v));
-  elseif a.ck == ccon and b.ck == ccon
-     and a.ccon == b.ccon and #a.args == #b.args then
-    local len = #a.args;
-    if len == 0 then
+  elseif (k == ccon or k == cvar) and b[1] == k
+     and a[2] == b[2] and #a == #b then
+    local len = #a;
+    if len == 2 then
       return true;
     end
-    for i=1,len-1 do
-      if not conv(n, a.args[i], b.args[i]) then
+    for i=3,len-1 do
+      if not conv(n, a[i], b[i]) then
         return false;
       end
     end
-    return conv(n, a.args[len], b.args[len]);
-  elseif a.ck == ctype and b.ck == ctype then
-    return true;
-  elseif a.ck == ckind and b.ck == ckind then
+    return conv(n, a[len], b[len]);
+  elseif (k == ctype or k == ckind) and b[1] == k then
     return true;
   else
     print("Terms are not convertible:");
@@ -83,61 +148,101 @@ function conv(n, a, b)
   end
 end
 
+function conv(n, a, b)
+  local ca = convc[a];
+  if a == b or ca and ca[b] then
+    convh = convh + 1;
+    return true;
+  end
+  convm = convm + 1;
+  if a[1] == cthk then fc(a); end
+  if b[1] == cthk then fc(b); end
+  if not convs(n, a, b) then
+    return false;
+  end
+  if not ca then
+    ca = setmetatable({}, weak);
+    convc[a] = ca;
+  end
+  ca[b] = true;
+  return true;
+end
+
+-- Print the hit rate of the conversion cache, this is called
+-- at the end of each module. The rate is printed when f is
+-- true, in profiling mode, or when DKCONV is set.
+local convshow = os.getenv("DKCONV");
+
+function convstats(f)
+  if not (f or convshow) then
+    return;
+  end
+  local t = convh + convm;
+  io.stderr:write(string.format("conv: %d calls, %d hits (%.1f%%)\n",
+                  t, convh, t > 0 and convh / t * 100 or 0));
+end
+
 --[[ Typechecking functions. ]]
 
 function synth(n, t)
-  assert(t.tk);
-  if t.tk == tbox then
-    return t.tbox[1];
-  elseif t.tk == ttype then
-    return { ck = ckind };
-  elseif t.tk == tlet then
-    return synth(n, t.tlet[3](t.tlet[1], t.tlet[2]));
-  elseif t.tk == tapp then
-    local c = synth(n, t.tapp[1]);
-    assert(c.ck == cpi and check(n, t.tapp[2], c.cpi[1]));
-    return c.cpi[2](t.tapp[3]);
+  local k = t[1];
+  assert(k >= tlam);
+  if k == tbox then
+    return tybox(t);
+  elseif k == ttype then
+    return { ckind };
+  elseif k == tlet then
+    return synth(n, t[4](t[2], t[3]));
+  elseif k == tapp then
+    local c = fc(synth(n, t[2]));
+    assert(c[1] == cpi and check(n, t[3], c[2]));
+    return c[3](t[4]);
   else
     error("Type synthesis failed.");
   end
 end
 
 function check(n, t, c)
-  assert(t.tk and c.ck);
-  if t.tk == tlam then
-    if c.ck ~= cpi then
+  local k = t[1];
+  if c[1] == cthk then fc(c); end
+  assert(k >= tlam and c[1] < tlam);
+  if k == tlam then
+    if c[1] ~= cpi then
       print("Type is:");
       print("    " .. strc(c));
       error("Type checking failed: Product expected.");
     end
     local v = var(n);
-    return check(n+1, t.tlam[2](box(c.cpi[1], v), v), c.cpi[2](v));
-  elseif t.tk == tpi then
-    if not check(n, t.tpi[1], { ck = ctype }) then
+    return check(n+1, t[2](box(c[2], v), v), c[3](v));
+  elseif k == tpi then
+    if not check(n, t[2], { ctype }) then
       error("Type checking failed: Invalid product.");
     end
     local v = var(n);
-    return check(n+1, t.tpi[3](box(t.tpi[2], v), v), c);
-  elseif t.tk == tlet then
-    return check(n, t.tlet[3](t.tlet[1], t.tlet[2]), c);
+    return check(n+1, t[4](box(t[3], v), v), c);
+  elseif k == tlet then
+    return check(n, t[4](t[2], t[3]), c);
   else
     return conv(n, synth(n, t), c);
   end
 end
 
 function chktype(t)
-  if not check(0, t, { ck = ctype }) then
+  convc = setmetatable({}, weak);
+  if not check(0, t, { ctype }) then
     error("Type checking failed: Sort error.");
   end
 end
 
 function chkkind(t)
-  if not check(0, t, { ck = ckind }) then
+  convc = setmetatable({}, weak);
+  if not check(0, t, { ckind }) then
     error("Type checking failed: Sort error.");
   end
 end
 
 function chk(t, c)
+  convc = setmetatable({}, weak);
   if not check(0, t, c) then
     error("Type checking failed: Terms are not convertible.");
   end
@@ -164,24 +269,219 @@ function chkend(x)
   shiftp("Done checking \027[32m" .. x .. "\027[m.");
 end
 
+--[[ Items. ]]
+
+-- The code generated for each declaration and rule set is a
+-- function passed to item, which runs it at once. Lua limits
+-- the constants, locals and upvalues of a single function,
+-- with one function per item these limits do not depend on
+-- the size of the module.
+
+function item(f)
+  return f();
+end
+
+--[[ Check units. ]]
+
+-- The code generated for each declaration and rule set wraps
+-- its type checking in a unit. Units are run as soon as they
+-- are reached, except when the script is run by a worker of
+-- the dkpar driver: then DKPAR_DIR names a directory holding
+-- one token file per unit, a worker claims a unit by renaming
+-- its token, writes the messages printed in a result file and
+-- the error raised, if any, in an error file.
+
+local pardir = os.getenv("DKPAR_DIR");
+local unitn = 0;
+
+function unit(f)
+  if not pardir then
+    return f();
+  end
+  unitn = unitn + 1;
+  local u = pardir .. "/" .. unitn;
+  if not os.rename(u .. ".t", u .. ".c") then
+    return;
+  end
+  local out, p = {}, print;
+  print = function (...)
+    local t = {...};
+    for i=1,select("#", ...) do
+      t[i] = tostring(t[i]);
+    end
+    table.insert(out, table.concat(t, "\t"));
+  end
+  local ok, err = pcall(f);
+  print = p;
+  indent = 0;
+  local h = assert(io.open(u .. ".r", "w"));
+  for _, l in ipairs(out) do
+    h:write(l, "\n");
+  end
+  h:close();
+  if not ok then
+    h = assert(io.open(u .. ".e", "w"));
+    h:write(tostring(err), "\n");
+    h:close();
+  end
+end
+
+--[[ Module loading. ]]
+
+-- The generated code calls dkload for each module it refers
+-- to and which it does not define. If the table of the module
+-- does not exist yet, it is bound to a placeholder, and the
+-- compiled file of the module is required on the first access
+-- to one of its symbols. The compiled file fills the
+-- placeholder, so a module is loaded once, and only if needed.
+
+function dkload(m)
+  local t, k = _G, nil;
+  for n in m:gmatch("[^.]+") do
+    if k then
+      if rawget(t, k) == nil then
+        rawset(t, k, {});
+      end
+      t = t[k];
+    end
+    k = n;
+  end
+  if rawget(t, k) ~= nil then
+    return;
+  end
+  rawset(t, k, setmetatable({}, { __index = function (p, x)
+    setmetatable(p, nil);
+    require(m);
+    return rawget(p, x);
+  end }));
+end
+
+--[[ Bytecode cache. ]]
+
+-- Compiled modules and bundles end with a line holding their
+-- key, a hash of their code. The first time such a file is
+-- loaded, the bytecode of its main function is saved next to
+-- it in a .luac file, with a header giving the key, the Lua
+-- version and the size of the bytecode, followed by the
+-- bytecode and a copy of the source. Later loads use the
+-- bytecode when the header matches and the copy is equal to
+-- the source, so a file edited without updating its key is
+-- not run from a stale cache. Hashing the source again in
+-- Lua would cost more than compiling it, comparing strings
+-- does not.
+
+-- Return the key of the opened file h, nil if it has none.
+local function dkkey(h)
+  local n = h:seek("end");
+  h:seek("set", math.max(n - 64, 0));
+  return h:read("*a"):match("%-%- dkkey (%x+)\n$");
+end
+
+-- Return the main function of the Lua file f, or nil and an
+-- error message.
+function dkloadfile(f)
+  local h, e = io.open(f, "rb");
+  if not h then
+    return nil, e;
+  end
+  local k = dkkey(h);
+  if not k then
+    h:close();
+    return loadfile(f);
+  end
+  local hd = k .. " " .. _VERSION .. " ";
+  local c = f:gsub("%.lua$", "") .. ".luac";
+  local ch, fn = io.open(c, "rb"), nil;
+  h:seek("set");
+  local s = h:read("*a");
+  h:close();
+  if ch then
+    local l = ch:read("*l");
+    local n = l and l:sub(1, #hd) == hd and tonumber(l:sub(#hd + 1));
+    if n then
+      local b = ch:read(n);
+      if b and #b == n and ch:read("*a") == s then
+        fn = loadstring(b);
+      end
+    end
+    ch:close();
+    if fn then
+      return fn;
+    end
+  end
+  fn, e = loadstring(s, "@" .. f);
+  if not fn then
+    return nil, e;
+  end
+  local b = string.dump(fn);
+  ch = io.open(c .. ".tmp", "wb");
+  if ch then
+    ch:write(hd, #b, "\n", b, s);
+    ch:close();
+    os.rename(c .. ".tmp", c);
+  end
+  return fn;
+end
+
+-- Run the Lua file f, using its bytecode cache.
+function dkdofile(f)
+  return assert(dkloadfile(f))();
+end
+
+-- Compiled modules required are loaded with dkloadfile.
+table.insert(package.loaders or package.searchers, 2, function (m)
+  local p = m:gsub("%.", "/");
+  for t in package.path:gmatch("[^;]+") do
+    local f = t:gsub("%?", p);
+    local h = io.open(f);
+    if h then
+      h:close();
+      return assert(dkloadfile(f));
+    end
+  end
+  return "\n\tno file for module '" .. m .. "'";
+end);
+
+--[[ Profiling functions. ]]
+
+local profc = {};
+
+function prof(k)
+  profc[k] = (profc[k] or 0) + 1;
+end
+
+function profdump()
+  local ks = {};
+  for k in pairs(profc) do
+    table.insert(ks, k);
+  end
+  table.sort(ks);
+  local f = assert(io.open(os.getenv("DKPROF") or "dkprof.out", "w"));
+  for _, k in ipairs(ks) do
+    f:write(k .. " " .. profc[k] .. "\n");
+  end
+  f:close();
+end
+
 --[[ Debugging functions. ]]
 
 function strc(c)
   local function f(n, c)
-    if c.ck == clam then
+    local k = fc(c)[1];
+    if k == clam then
       return "(\\" .. n .. ". " .. f(n+1, ap(c, var(n))) ..")";
-    elseif c.ck == cpi then
-      return "(Pi " .. n .. ":" .. f(n, c.cpi[1])
-          .. ". " .. f(n+1, c.cpi[2](var(n))) .. ")";
-    elseif c.ck == ccon then
-      local s = "(" .. c.ccon;
-      for _, arg in ipairs(c.args) do
-        s = s .. " " .. f(n, arg);
+    elseif k == cpi then
+      return "(Pi " .. n .. ":" .. f(n, c[2])
+          .. ". " .. f(n+1, c[3](var(n))) .. ")";
+    elseif k == ccon or k == cvar then
+      local s = "(" .. (k == ccon and c[2] or "var" .. c[2]);
+      for i = 3, #c do
+        s = s .. " " .. f(n, c[i]);
       end
       return s .. ")";
-    elseif c.ck == ctype then
+    elseif k == ctype then
       return "Type";
-    elseif c.ck == ckind then
+    elseif k == ckind then
       return "Kind";
     else
       return "!! not code !!";
@@ -0,0 +1,129 @@
+#!/usr/bin/env lua
+-- Dedukti parallel checking driver.
+--
+-- The Lua code produced by dkparse type checks declarations
+-- and rule sets in independent check units. This driver runs
+-- the code in several worker processes, all of them build the
+-- signature but each unit is checked by the first worker that
+-- claims it. Messages are printed in declaration order once
+-- all workers are done.
+
+local jobs, lua, file = 2, "lua", nil;
+
+local function usage()
+  io.stderr:write("usage: dkpar [-j N] [-l LUA] FILE\n");
+  os.exit(1);
+end
+
+local function quote(s)
+  return "'" .. s:gsub("'", "'\\''") .. "'";
+end
+
+-- Run a shell command, return true if it succeeded. Lua 5.1
+-- returns the exit status and later versions a boolean.
+local function sh(c)
+  local r = os.execute(c);
+  return r == true or r == 0;
+end
+
+local o = 1;
+while arg[o] do
+  if arg[o] == "-j" and arg[o+1] then
+    jobs = tonumber(arg[o+1]) or usage();
+    o = o + 2;
+  elseif arg[o] == "-l" and arg[o+1] then
+    lua = arg[o+1];
+    o = o + 2;
+  elseif not file then
+    file = arg[o];
+    o = o + 1;
+  else
+    usage();
+  end
+end
+if not file then
+  usage();
+end
+
+-- Workers run the code several times, standard input is saved
+-- to a temporary file.
+local tmp;
+if file == "-" then
+  tmp = os.tmpname();
+  local h = assert(io.open(tmp, "w"));
+  h:write(io.read("*a"));
+  h:close();
+  file = tmp;
+end
+
+-- Count units and create their tokens.
+local n = 0;
+for l in io.lines(file) do
+  if l:match("^unit%(function") then
+    n = n + 1;
+  end
+end
+local dir = os.tmpname();
+os.remove(dir);
+if not sh("mkdir " .. quote(dir)) then
+  io.stderr:write("Cannot create " .. dir .. ".\n");
+  os.exit(1);
+end
+for i=1,n do
+  assert(io.open(dir .. "/" .. i .. ".t", "w")):close();
+end
+
+-- Run workers and wait for them.
+local cmd = {};
+for w=1,jobs do
+  table.insert(cmd, string.format("(DKPAR_DIR=%s %s -l dedukti %s >/dev/null; echo $? > %s/w%d) &",
+    quote(dir), lua, quote(file), quote(dir), w));
+end
+table.insert(cmd, "wait");
+local status = 0;
+if not sh(table.concat(cmd, " ")) then
+  io.stderr:write("Cannot run workers.\n");
+  status = 1;
+end
+
+-- Print results in order, stop at the first failure.
+for i=1,status == 0 and n or 0 do
+  local h = io.open(dir .. "/" .. i .. ".r");
+  if not h then
+    io.stderr:write("Check unit " .. i .. " was not run.\n");
+    status = 1;
+    break;
+  end
+  io.write(h:read("*a"));
+  h:close();
+  h = io.open(dir .. "/" .. i .. ".e");
+  if h then
+    io.stderr:write(h:read("*a"));
+    h:close();
+    status = 1;
+    break;
+  end
+end
+if status == 0 then
+  for w=1,jobs do
+    local h = io.open(dir .. "/w" .. w);
+    if not h or h:read("*n") ~= 0 then
+      io.stderr:write("Worker " .. w .. " failed.\n");
+      status = 1;
+    end
+    if h then
+      h:close();
+    end
+  end
+end
+
+if not sh("rm -rf " .. quote(dir)) then
+  io.stderr:write("Cannot remove " .. dir .. ".\n");
+  status = 1;
+end
+if tmp then
+  os.remove(tmp);
+end
+os.exit(status);
+
+-- vi: expandtab: sw=2
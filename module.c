@@ -16,6 +16,12 @@
 static char qid[IDLEN];
 static char *id;
 
+/* internal mnum - The number of the current module, it is
+ * incremented by mset and numbers the qualified atoms cached
+ * by mqual.
+ */
+static unsigned mnum;
+
 /* internal copyto - Copy chars between two string pointers
  * after the s pointer in the qid array. The s pointer must
  * point inside the qid array. If a non null pointer is
@@ -54,6 +60,7 @@ mset(char *path)
 {
 	char *p;
 
+	mnum++;
 	id=qid;
 	while ((p=strchr(path, DIRSEP))) {
 		id=copyto(id, path, p);
@@ -72,6 +79,29 @@ mset(char *path)
 	return !id;
 }
 
+/* mname - Set the current module from its name m, in which
+ * module components are separated by dots, the return value
+ * is the one of mset. It is used when the module is not read
+ * from a file named after it.
+ */
+int
+mname(char *m)
+{
+	char *p;
+
+	mnum++;
+	id=qid;
+	while ((p=strchr(m, '.'))) {
+		id=copyto(id, m, p);
+		if (!id)
+			return 1;
+		*id++='.';
+		m=p+1;
+	}
+	id=copyto(id, m, m+strlen(m));
+	return !id;
+}
+
 /* mget - Get the current module name. It returns a pointer on
  * a static null terminated string.
  */
@@ -83,13 +113,21 @@ mget(void)
 }
 
 /* mqual - Qualify a variable name. It returns a pointer on
- * an atom containing the qualified name.
+ * an atom containing the qualified name. The argument must
+ * be an atom, the result is cached in it until the current
+ * module changes.
  */
 char *
 mqual(char *x)
 {
+	char *q;
+
+	if ((q=aqget(x, mnum)))
+		return q;
 	*id='.';
 	if (!copyto(id+1, x, x+strlen(x)+1))
 		exit(1); // FIXME
-	return astrdup(qid, id-qid+1);
+	q=astrdup(qid, id-qid+1);
+	aqset(x, mnum, q);
+	return q;
 }
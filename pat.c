@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include "dk.h"
 
@@ -51,7 +52,8 @@ pains(struct PArr *pa, void *p)
 /* mkpat - Create a pattern node, the first parsing array
  * stores parsed terms (dot patterns), the second stores
  * parsed patterns. The string argument in c is the
- * applied constructor/variable.
+ * applied constructor/variable. Sub patterns are linked
+ * to the new node, this gives them their path.
  */
 struct Pat *
 mkpat(char *c, struct PArr *pads, struct PArr *paps)
@@ -61,22 +63,25 @@ mkpat(char *c, struct PArr *pads, struct PArr *paps)
 
 	p=dkalloc(sizeof *p);
 	p->c=c;
-	p->nd=p->np=0;
-	p->loc=0;
+	p->nd=p->np=p->a=0;
 	p->ds=0;
 	p->ps=0;
+	p->up=0;
 	if (pads) {
 		p->nd=pads->i;
 		p->ds=dkalloc(p->nd*sizeof *p->ds);
 		for (s=0; s<p->nd; s++)
-			p->ds[s]=(struct Term *)pads->p[s];
+			p->ds[s]=(Term)(uintptr_t)pads->p[s];
 		free(pads);
 	}
 	if (paps) {
 		p->np=paps->i;
 		p->ps=dkalloc(p->np*sizeof *p->ps);
-		for (s=0; s<p->np; s++)
+		for (s=0; s<p->np; s++) {
 			p->ps[s]=(struct Pat *)paps->p[s];
+			p->ps[s]->up=p;
+			p->ps[s]->a=p->nd+s+1;
+		}
 		free(paps);
 	}
 	return p;
@@ -151,96 +156,89 @@ tget(struct Arr *a, char *x)
 
 /* ------------- Pattern checking. ------------- */
 
-/* MAXPDPTH - The maximum depth of a pattern.
- */
-#define MAXPDPTH 32
-
 /* internal rvp - The associative array used to store
  * the mapping from pattern variables of the current
  * rule to paths.
  */
 static struct VPth *rvp;
 
-/* internal ploc - This stores the current path during the
- * checking of patterns.
- */
-static int ploc[MAXPDPTH];
-
-/* internal duppath - Duplicate the current path and return it.
- * The returned path will be a 0 terminated array of dpth+1
- * elements.
- */
-static int *
-duppath(int dpth)
-{
-	int *p=dkalloc((dpth+1)*sizeof *p);
-	int i;
-
-	for (i=0; i<dpth; i++)
-		p[i]=ploc[i];
-	p[i]=0;
-	return p;
-}
-
-/* internal vsetpath - Bind one variable to the current path.
+/* internal vsetpath - Bind one variable to its occurrence.
  */
 static void
-vsetpath(int dpth, char *x)
+vsetpath(struct Pat *p)
 {
 	int i;
 
-	for (i=0; rvp[i].x!=x; i++)
+	for (i=0; rvp[i].x!=p->c; i++)
 		;
-	rvp[i].p=duppath(dpth);
+	rvp[i].p=p;
 	return;
 }
 
+/* struct PFrm - A pattern being checked, a is the index of
+ * the next sub pattern to check.
+ */
+struct PFrm {
+	struct Pat *p;
+	int a;
+};
+
 /* internal chkpat - Check that a nested pattern respects
- * well formation rules, it also fills location information
- * (in the pattern and in the rvp array for variables).
+ * well formation rules, it also binds variables to their
+ * occurrence in the rvp array. Sub patterns are checked
+ * before their parent, an explicit stack of frames is used.
  */
 static int
-chkpat(int dpth, struct Pat *p)
+chkpat(struct Pat *p)
 {
+	static struct Stk pfrms = STK(struct PFrm);
+	size_t b=pfrms.i;
 	int a;
 	struct IdN id;
-
-	if (dpth>=MAXPDPTH) {
-		fprintf(stderr, "%s: Maximum pattern depth exceeded.\n"
-		                "\tThe maximum is %d.\n", __func__, MAXPDPTH);
-		exit(1); // FIXME
-	
-	}
-	id.x=p->c;
-	if (p->np<0) { /* We recognized a variable. */
-		id.n=tget(&vr, id.x)+1;
-		tset(&vr, id);
-		vsetpath(dpth, id.x);
-		return 0;
-	}
-	for (a=0; a<p->np; a++) {
-		ploc[dpth]=a+p->nd+1;
-		if (chkpat(dpth+1, p->ps[a]))
-			return 1;
-	}
-	id.n=p->nd;
-	a=tset(&dar, id);
-	if (a>=0 && a!=id.n) {
-		fprintf(stderr, "%s: Constructor %s must not have several"
-		                " dot arities (%d and %d).\n"
-		              , __func__, id.x, a, id.n);
-		return 1;
-	}
-	id.n=p->np;
-	a=tset(&par, id);
-	if (a>=0 && a!=id.n) {
-		fprintf(stderr, "%s: Constructor %s must not have several"
-		                " regular arities (%d and %d).\n"
-		              , __func__, id.x, a, id.n);
-		return 1;
+	struct PFrm f, *pf;
+
+	f.p=p;
+	f.a=0;
+	spush(&pfrms, &f);
+	while (pfrms.i>b) {
+		pf=stop(&pfrms);
+		p=pf->p;
+		id.x=p->c;
+		if (p->np<0) { /* We recognized a variable. */
+			id.n=tget(&vr, id.x)+1;
+			tset(&vr, id);
+			vsetpath(p);
+			pfrms.i--;
+			continue;
+		}
+		if (pf->a<p->np) {
+			f.p=p->ps[pf->a++];
+			f.a=0;
+			spush(&pfrms, &f);
+			continue;
+		}
+		id.n=p->nd;
+		a=tset(&dar, id);
+		if (a>=0 && a!=id.n) {
+			fprintf(stderr, "%s: Constructor %s must not have several"
+			                " dot arities (%d and %d).\n"
+			              , __func__, id.x, a, id.n);
+			goto err;
+		}
+		id.n=p->np;
+		a=tset(&par, id);
+		if (a>=0 && a!=id.n) {
+			fprintf(stderr, "%s: Constructor %s must not have several"
+			                " regular arities (%d and %d).\n"
+			              , __func__, id.x, a, id.n);
+			goto err;
+		}
+		pfrms.i--;
 	}
-	p->loc=duppath(dpth);
 	return 0;
+err:
+	pfrms.i=b;
+	return 1;
 }
 
 /* internal chkenv - Checks that a member of the environment
@@ -248,7 +246,7 @@ chkpat(int dpth, struct Pat *p)
  * *(int *)peerr to 1.
  */
 static void
-chkenv(char *x, struct Term *t, void *peerr)
+chkenv(char *x, Term t, void *peerr)
 {
 	int a;
 
@@ -271,7 +269,7 @@ chkenv(char *x, struct Term *t, void *peerr)
  * the p fields are set to 0.
  */
 static void
-fillvpa(char *x, struct Term *t, void *ppa)
+fillvpa(char *x, Term t, void *ppa)
 {
 	struct VPth **pp=ppa;
 
@@ -282,9 +280,8 @@ fillvpa(char *x, struct Term *t, void *ppa)
 
 /* pchk - Check that a given rule pattern respect well
  * formation rules with respect to the rule environment.
- * It also fills location information for contructors and
- * variables by filling loc fields in r->l, and by
- * allocating and filling the r->vpa array.
+ * It also allocates and fills the r->vpa array which maps
+ * variables to their occurrence in r->l.
  * If the pattern is not valid, 1 is returned, 0
  * otherwise.
  */
@@ -310,11 +307,9 @@ pchk(struct Rule *r)
 	} else
 		rvp=r->vpa=0;
 	vr.i=0;
-	for (i=0; i<r->l->np; i++) {
-		ploc[0]=r->l->nd+i+1;
-		if (chkpat(1, r->l->ps[i]))
+	for (i=0; i<r->l->np; i++)
+		if (chkpat(r->l->ps[i]))
 			return 1;
-	}
 	eerr=0;
 	eiter(r->e, chkenv, &eerr); /* Check linearity. */
 	return eerr;
@@ -16,7 +16,7 @@ static struct RSet rs;
  * memory is available, 1 is returned, otherwise, 0 is returned.
  */
 int
-pushrule(struct Env *e, struct Pat *l, struct Term *r)
+pushrule(struct Env *e, struct Pat *l, Term r)
 {
 	if (rs.i>=MAXRULES) {
 		fprintf(stderr, "%s: Too many rules accumulated.\n"
@@ -27,7 +27,7 @@ struct L {
  */
 struct Env {
 	struct L l;
-	struct Term *t;
+	Term t;
 	struct Env *p;
 };
 
@@ -46,6 +46,12 @@ struct Id {
  */
 extern struct Tree *genv;
 
+/* internal cells - This stack stores the environment cells
+ * allocated while scoping a term, they are freed once the
+ * whole term is scoped.
+ */
+static struct Stk cells = STK(struct L *);
+
 /* internal cons - Add a value to the current environment.
  */
 static inline void
@@ -55,64 +61,80 @@ cons(char *s, struct L **l)
 	car->s=s;
 	car->n=*l;
 	*l=car;
+	spush(&cells, &car);
 }
 
+/* struct TFrm - A term to scope with its local environment,
+ * this is used to scope terms without recursion.
+ */
+struct TFrm {
+	Term t;
+	struct L *e;
+};
+
 /* internal tscp - Check that a term is well scoped within
  * the global environment and the local pe environment. This
  * will also qualify all unbound names with the current module
  * name.
  */
 static int
-tscp(struct Term *t, struct L *pe)
+tscp(Term t, struct L *pe)
 {
+	static struct Stk tfrms = STK(struct TFrm);
+	size_t b=tfrms.i, c=cells.i;
 	int r=0;
 	struct L *p, *e=pe;
 	struct Id id;
-
-tail:
-	switch (t->typ) {
-	case App:
-		r=tscp(t->uapp.t1, e);
-		if (r) break;
-		t=t->uapp.t2;
-		goto tail;
-		break;
-	case Lam:
-		cons(t->ulam.x, &e);
-		t=t->ulam.t;
-		goto tail;
-		break;
-	case Pi:
-		r=tscp(t->upi.ty, e);
-		if (r) break;
-		if (t->upi.x)
-			cons(t->upi.x, &e);
-		t=t->upi.t;
-		goto tail;
-		break;
-	case Var:
-		for (p=e; p; p=p->n)
-			if (p->s==t->uvar)
-				goto ret;
-		if (aqual(t->uvar)) /* XXX Temporary hack to handle modules. */
-			goto ret;
-		t->uvar=mqual(t->uvar);
-		id.x=t->uvar;
-		if (avlget(&id, genv))
-			goto ret;
-		fprintf(stderr, "%s: Variable %s is out of scope.\n", __func__, id.x);
-		r=1;
-		break;
-	case Type:
-		break;
+	struct TFrm f;
+
+	for (;;) {
+		switch (tkind(t)) {
+		case App:
+			f.t=tr(t);
+			f.e=e;
+			spush(&tfrms, &f);
+			t=tl(t);
+			continue;
+		case Lam:
+			cons(tx(t), &e);
+			t=tr(t);
+			continue;
+		case Pi:
+			f.t=tr(t);
+			f.e=e;
+			if (tx(t))
+				cons(tx(t), &f.e);
+			spush(&tfrms, &f);
+			t=tl(t);
+			continue;
+		case Var:
+			for (p=e; p; p=p->n)
+				if (p->s==tx(t))
+					break;
+			if (p)
+				break;
+			if (aqual(tx(t))) /* XXX Temporary hack to handle modules. */
+				break;
+			tx(t)=mqual(tx(t));
+			id.x=tx(t);
+			if (avlget(&id, genv))
+				break;
+			fprintf(stderr, "%s: Variable %s is out of scope.\n", __func__, id.x);
+			r=1;
+			break;
+		case Type:
+			break;
+		}
+		if (r || tfrms.i==b)
+			break;
+		spop(&tfrms, &f);
+		t=f.t;
+		e=f.e;
 	}
-ret:
-	p=e;
-	while (p!=pe) {
-		struct L *tmp;
-		tmp=p->n;
+	tfrms.i=b;
+	while (cells.i>c) {
+		spop(&cells, &p);
 		free(p);
-		p=tmp;
 	}
 	return r;
 }
@@ -122,7 +144,7 @@ ret:
  * If the term is not well scoped, 1 is returned, 0 otherwise.
  */
 int
-tscope(struct Term *t, struct Env *e)
+tscope(Term t, struct Env *e)
 {
 	return tscp(t, (struct L *)e);
 }
@@ -133,46 +155,52 @@ tscope(struct Term *t, struct Env *e)
  */
 static struct L *penv;
 
-/* internal pscp - Scope a pattern, in a recursive fashion.
+/* internal pscp - Scope a pattern, the pattern nodes are
+ * stored on an explicit stack.
  */
 static int
 pscp(struct Pat *p)
 {
+	static struct Stk pats = STK(struct Pat *);
+	size_t b=pats.i;
 	int i;
 	struct L *e;
 	struct Id id;
 
-tail:
-	for (e=penv; e; e=e->n)
-		if (e->s==p->c) {
+	spush(&pats, &p);
+	while (pats.i>b) {
+		spop(&pats, &p);
+		for (e=penv; e; e=e->n)
+			if (e->s==p->c)
+				break;
+		if (e) {
 			if (p->nd+p->np==0) {
 				p->np=-1;
-				return 0;
+				continue;
 			}
 			fprintf(stderr, "%s: Pattern variable %s must not"
 					" be applied.\n", __func__, p->c);
-			return 1;
+			goto err;
+		}
+		if (!aqual(p->c)) { /* XXX Temporary hack to handle modules. */
+			p->c=mqual(p->c); /* Not in local scope, qualify it. */
+			id.x=p->c;
+			if (!avlget(&id, genv)) {
+				fprintf(stderr, "%s: Constructor %s is out of scope.\n"
+				              , __func__, id.x);
+				goto err;
+			}
 		}
-	if (aqual(p->c)) /* XXX Temporary hack to handle modules. */
-		goto scopechild;
-	p->c=mqual(p->c); /* Not in local scope, qualify it. */
-	id.x=p->c;
-	if (avlget(&id, genv))
-		goto scopechild;
-	fprintf(stderr, "%s: Constructor %s is out of scope.\n", __func__, id.x);
+		for (i=0; i<p->nd; i++)
+			if (tscp(p->ds[i], penv))
+				goto err;
+		for (i=p->np-1; i>=0; i--)
+			spush(&pats, &p->ps[i]);
+	}
+	return 0;
+err:
+	pats.i=b;
 	return 1;
-
-scopechild:
-	for (i=0; i<p->nd; i++)
-		if (tscp(p->ds[i], penv))
-			return 1;
-	if (p->np==0)
-		return 0;
-	for (i=0; i<p->np-1; i++)
-		if (pscp(p->ps[i]))
-			return 1;
-	p=p->ps[i];
-	goto tail;
 }
 
 /* pscope - Scope a pattern in the global environment plus the
@@ -262,7 +290,7 @@ chscope(char *x, enum IdStatus st)
  * cell is allocated on the temporary heap.
  */
 struct Env *
-eins(struct Env *e, char *id, struct Term *ty)
+eins(struct Env *e, char *id, Term ty)
 {
 	struct Env *pe=dkalloc(sizeof *pe);
 
@@ -281,7 +309,7 @@ eins(struct Env *e, char *id, struct Term *ty)
 /* eget - Retreive a type from the environment, if the given
  * identifier does not have a matching type, 0 is returned.
  */
-struct Term *
+Term
 eget(struct Env *e, char *x)
 {
 	while (e) {
@@ -295,7 +323,7 @@ eget(struct Env *e, char *x)
 /* eiter - Iterate a function on an environment.
  */
 void
-eiter(struct Env *e, void (*f)(char *, struct Term *, void *), void *p)
+eiter(struct Env *e, void (*f)(char *, Term, void *), void *p)
 {
 	struct Env *pe;
 
@@ -1,52 +1,54 @@
 #include "dk.h"
 
-struct Term *ttype = &(struct Term){ Type };
+/* mktype - Build a Type node.
+ */
+Term
+mktype(void)
+{
+	return tnew(tcur, Type);
+}
 
 /* mkapp - Build an application node.
  */
-struct Term *
-mkapp(struct Term *a, struct Term *b)
+Term
+mkapp(Term a, Term b)
 {
-	struct Term *t = dkalloc(sizeof *t);
-	t->typ = App;
-	t->uapp.t1 = a;
-	t->uapp.t2 = b;
+	Term t = tnew(tcur, App);
+	tl(t) = a;
+	tr(t) = b;
 	return t;
 }
 
 /* mkvar - Build a variable node.
  */
-struct Term *
+Term
 mkvar(char *s)
 {
-	struct Term *t = dkalloc(sizeof *t);
-	t->typ = Var;
-	t->uvar = s;
+	Term t = tnew(tcur, Var);
+	tx(t) = s;
 	return t;
 }
 
 /* mklam - Build a lambda node.
  */
-struct Term *
-mklam(char *s, struct Term *a)
+Term
+mklam(char *s, Term a)
 {
-	struct Term *t = dkalloc(sizeof *t);
-	t->typ = Lam;
-	t->ulam.x = s;
-	t->ulam.t = a;
+	Term t = tnew(tcur, Lam);
+	tx(t) = s;
+	tr(t) = a;
 	return t;
 }
 
 /* mkpi - Build a Pi node.
  */
-struct Term *
-mkpi(char *s, struct Term *ty, struct Term *a)
+Term
+mkpi(char *s, Term ty, Term a)
 {
-	struct Term *t = dkalloc(sizeof *t);
-	t->typ = Pi;
-	t->upi.x = s;
-	t->upi.ty = ty;
-	t->upi.t = a;
+	Term t = tnew(tcur, Pi);
+	tx(t) = s;
+	tl(t) = ty;
+	tr(t) = a;
 	return t;
 }
 
@@ -56,11 +58,11 @@ mkpi(char *s, struct Term *ty, struct Term *a)
  * spine is assigned to the object pointed by p.
  */
 int
-napps(struct Term *t, struct Term **p)
+napps(Term t, Term *p)
 {
 	int r;
 
-	for (r=0; t->typ==App; t=t->uapp.t1)
+	for (r=0; tkind(t)==App; t=tl(t))
 		r++;
 	if (p)
 		*p=t;
@@ -72,9 +74,9 @@ napps(struct Term *t, struct Term **p)
  * of products ending on Type.
  */
 int
-iskind(struct Term *t)
+iskind(Term t)
 {
-	while (t->typ==Pi)
-		t=t->upi.t;
-	return t==ttype;
+	while (tkind(t)==Pi)
+		t=tr(t);
+	return tkind(t)==Type;
 }
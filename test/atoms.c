@@ -0,0 +1,113 @@
+/* atoms - Measure the throughput of atom interning when it is
+ * done concurrently by several threads. This is used by the
+ * benchmark scripts.
+ *
+ *     usage: atoms [N]
+ *
+ * Each thread interns N identifiers, half of them are shared
+ * by all threads and half are private, this is repeated with
+ * 1, 2, 4 and 8 threads. Every round starts from an empty atom
+ * table. Each round is run twice, once with the lock free
+ * astrdup and once with calls serialized by a mutex, as was
+ * done before. The best throughput of REPS runs is kept and
+ * its ratio to the single thread lock free one is printed.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../dk.h"
+
+#define MAXTHR 8
+#define REPS   5
+
+static int n, locked;
+static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void *
+intern(void *a)
+{
+	char s[IDLEN], *p;
+	int i, t=(int)(long)a;
+
+	for (i=0; i<n; i++) {
+		if (i&1)
+			sprintf(s, "Mod.shared%d", i);
+		else
+			sprintf(s, "Mod.priv%d_%d", t, i);
+		if (locked)
+			pthread_mutex_lock(&lock);
+		p=astrdup(s, 4);
+		if (locked)
+			pthread_mutex_unlock(&lock);
+		if (strcmp(p, s)!=0) {
+			fprintf(stderr, "Invalid atom %s.\n", s);
+			exit(1);
+		}
+	}
+	return 0;
+}
+
+/* internal run - Intern with k threads, each time in a fresh
+ * atom table, and return the best throughput.
+ */
+static double
+run(int k)
+{
+	pthread_t th[MAXTHR];
+	double t, best=0;
+	long i;
+	int r;
+
+	for (r=0; r<REPS; r++) {
+		initalloc();
+		t=now();
+		for (i=0; i<k; i++)
+			if (pthread_create(&th[i], 0, intern, (void *)i)) {
+				fprintf(stderr, "Cannot create thread.\n");
+				exit(1);
+			}
+		for (i=0; i<k; i++)
+			pthread_join(th[i], 0);
+		t=now()-t;
+		deinitalloc();
+		if (k*n/t>best)
+			best=k*n/t;
+	}
+	return best;
+}
+
+int
+main(int argc, char **argv)
+{
+	double r, rl, r1=0;
+	int k;
+
+	n=argc>1?atoi(argv[1]):20000;
+	if (n<=0) {
+		fprintf(stderr, "usage: %s [N]\n", argv[0]);
+		exit(1);
+	}
+	printf("%8s %12s %8s %12s %8s\n", "threads", "atoms/s", "speedup", "locked", "speedup");
+	for (k=1; k<=MAXTHR; k*=2) {
+		locked=0;
+		r=run(k);
+		locked=1;
+		rl=run(k);
+		if (k==1)
+			r1=r;
+		printf("%8d %12.0f %8.2f %12.0f %8.2f\n", k, r, r/r1, rl, rl/r1);
+	}
+	exit(0);
+}
@@ -0,0 +1,180 @@
+--[[ Synthetic scaling benchmarks. ]]
+
+-- Each generator returns the contents of a .dk file where
+-- one parameter stressing dkparse scales with n. The sizes
+-- list gives the values of n used for the benchmark. To get
+-- measurable running times, generators repeat the stressing
+-- item REPS times with fresh names.
+
+local REPS = 100
+
+local function rep(f)
+    local t = {}
+    for i = 1, REPS do
+        t[#t+1] = f(i)
+    end
+    return table.concat(t)
+end
+
+local function idn(i, l)
+    local s = "c" .. i
+    return s .. string.rep("_", l - #s)
+end
+
+local gens = {
+    { name = "decls", sizes = { 1000, 2000, 4000, 8000, 16000 },
+      gen = function (n)
+          local t = { "T : Type.\n" }
+          for i = 1, n do
+              t[#t+1] = string.format("c%d : T.\n", i)
+          end
+          return table.concat(t)
+      end },
+    { name = "depth", sizes = { 32, 64, 128, 256, 512 },
+      gen = function (n)
+          local t = string.rep("f (", n) .. "c" .. string.rep(")", n)
+          return "T : Type.\nc : T.\nf : T -> T.\n" .. rep(function (i)
+              return string.format("t%d : T.\n[] t%d --> %s.\n", i, i, t)
+          end)
+      end },
+    { name = "width", sizes = { 16, 32, 64, 128, 256 },
+      gen = function (n)
+          local s = "T : Type.\nc : T.\ng : " .. string.rep("T -> ", n) .. "T.\n"
+          return s .. rep(function (i)
+              return string.format("t%d : T.\n[] t%d --> g%s.\n", i, i, string.rep(" c", n))
+          end)
+      end },
+    { name = "binders", sizes = { 64, 128, 256, 512, 1024 },
+      gen = function (n)
+          local t = { }
+          for i = 1, n do
+              t[#t+1] = string.format("x%d : T => ", i)
+          end
+          t = table.concat(t) .. "c"
+          return "T : Type.\nc : T.\n" .. rep(function (i)
+              return string.format("t%d : %sT.\n[] t%d --> %s.\n", i, string.rep("T -> ", n), i, t)
+          end)
+      end },
+    { name = "rules", sizes = { 2, 4, 8, 16, 32 },
+      gen = function (n)
+          local t = { "T : Type.\n" }
+          for i = 1, n do
+              t[#t+1] = string.format("k%d : T.\n", i)
+          end
+          return table.concat(t) .. rep(function (i)
+              local r = { string.format("h%d : T -> T.\n", i) }
+              for j = 1, n do
+                  r[#r+1] = string.format("[] h%d k%d --> k%d\n", i, j, n - j + 1)
+              end
+              r[#r+1] = string.format(".\nt%d : T.\n[] t%d --> h%d k%d.\n", i, i, i, n)
+              return table.concat(r)
+          end)
+      end },
+    { name = "patdepth", sizes = { 16, 32, 64, 128, 256 },
+      gen = function (n)
+          local function s(x)
+              return string.rep("(S ", n) .. x .. string.rep(")", n)
+          end
+          return "T : Type.\nc : T.\nS : T -> T.\n" .. rep(function (i)
+              return string.format("d%d : T -> T.\n[x : T] d%d %s --> x.\n", i, i, s("x"))
+                  .. string.format("t%d : T.\n[] t%d --> d%d %s.\n", i, i, i, s("c"))
+          end)
+      end },
+    { name = "idlen", sizes = { 8, 16, 32, 64, 112 },
+      gen = function (n)
+          local t = { "T : Type.\n" }
+          for i = 1, 4000 do
+              t[#t+1] = idn(i, n) .. " : T.\n"
+          end
+          return table.concat(t)
+      end },
+}
+
+--[[ Benchmark execution. ]]
+
+local path, only = nil, nil -- Benchmark program options.
+
+-- Default path to the directory just above.
+do
+    local f = io.popen("cd ..; pwd")
+    path = f:lines()()
+    f:close()
+end
+
+-- Return the current time in seconds.
+local function now()
+    local f = io.popen("date +%s.%N")
+    local t = tonumber(f:read("*a"))
+    f:close()
+    return t
+end
+
+-- Run a shell command and return its wall clock running
+-- time, nil is returned if the command failed.
+local function timed(cmd)
+    local t = now()
+    local r = os.execute("(" .. cmd .. ") 2>/dev/null >/dev/null")
+    if r ~= 0 and r ~= true then return nil end
+    return now() - t
+end
+
+local function fmt(t)
+    return t and string.format("%8.3f", t) or "  failed"
+end
+
+-- Scaling ratio between two successive measures, the ratio
+-- of sizes is used to normalize it, hence a value close to 1
+-- means linear behavior and larger values signal superlinear
+-- behavior.
+local function ratio(t0, t1, n0, n1)
+    if not (t0 and t1) or t0 < 0.01 then return "     -" end
+    local r = (t1 / t0) / (n1 / n0)
+    return string.format("%6.2f%s", r, r > 1.5 and " !" or "")
+end
+
+function bench(dir, b)
+    print(string.format("\t-- Scaling %s --", b.name))
+    print(string.format("%8s %8s %8s %8s %8s", "n", "dkparse", "ratio", "lua", "ratio"))
+    local last
+    for _, n in ipairs(b.sizes) do
+        local f = string.format("%s%d", b.name, n)
+        local h = assert(io.open(dir .. "/" .. f .. ".dk", "w"))
+        h:write(b.gen(n))
+        h:close()
+        local cd = string.format("cd %s; ", dir)
+        local tp = timed(string.format("%s%s/dkparse %s.dk > %s.lua", cd, path, f, f))
+        local tl = tp and timed(string.format("%sLUA_PATH=%s/lua/?.lua lua -l dedukti %s.lua", cd, path, f))
+        print(string.format("%8d %8s %8s %8s %8s", n, fmt(tp),
+            last and ratio(last.tp, tp, last.n, n) or "     -", fmt(tl),
+            last and ratio(last.tl, tl, last.n, n) or "     -"))
+        last = { n = n, tp = tp, tl = tl }
+    end
+    print("")
+end
+
+-- Parse arguments.
+for o = 1, #arg do
+    if arg[o] == "-p" and arg[o+1] then
+        path = arg[o+1]
+    elseif arg[o] == "-b" and arg[o+1] then
+        only = arg[o+1]
+    elseif arg[o] == "-h" then
+        print("usage: bench.lua [-p PATH] [-b BENCH] [-h]")
+        print("\t-p\tSet the root path of the project.")
+        print("\t-b\tOnly run the given benchmark.")
+        print("\t-h\tDisplay this help message.")
+        return
+    end
+end
+
+-- Run benchmarks in a temporary directory.
+local dir = os.tmpname()
+os.remove(dir)
+os.execute("mkdir " .. dir)
+for _, b in ipairs(gens) do
+    if not only or only == b.name then
+        bench(dir, b)
+    end
+end
+os.execute("rm -rf " .. dir)
+print("Ratios are normalized by the growth of n, values above 1.5 are marked.")
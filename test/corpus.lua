@@ -0,0 +1,191 @@
+--[[ Modify this section to add more developments. ]]
+
+-- Each development is a list of modules type checked in a
+-- row, in the given order.
+local devs = {
+    { name = "coq", cat = "coq", mods = { "Coq1univ", "Coq_Init_Logic" } },
+    { name = "hol", cat = "hol", mods = { "hol" } },
+}
+
+-- Metrics recorded for each development, tol is the relative
+-- regression tolerated and slack is an absolute difference
+-- under which changes are considered as noise.
+local metrics = {
+    { name = "parse", unit = "s",  tol = 0.25, slack = 0.02 },
+    { name = "size",  unit = "B",  tol = 0.05, slack = 0 },
+    { name = "load",  unit = "s",  tol = 0.25, slack = 0.02 },
+    { name = "check", unit = "s",  tol = 0.25, slack = 0.05 },
+    { name = "prss",  unit = "kB", tol = 0.25, slack = 1024 },
+    { name = "crss",  unit = "kB", tol = 0.25, slack = 1024 },
+}
+
+--[[ Benchmark execution. ]]
+
+-- The baseline stored in test/corpus.base holds timings of
+-- the reference machine, run with -w after a change which is
+-- known to alter performance, or on a new machine.
+
+-- Benchmark program options.
+local path, base, write, runs, scale = nil, nil, false, 3, 1
+
+-- Default path to the directory just above.
+do
+    local f = io.popen("cd ..; pwd")
+    path = f:lines()()
+    f:close()
+end
+
+-- Console tools.
+local function green(s) return "\027[32m" .. s .. "\027[m" end
+local function   red(s) return "\027[31m" .. s .. "\027[m" end
+
+-- Run a shell command under test/rusage and return its CPU
+-- time and peak memory usage, nil is returned if the command
+-- failed.
+local function measure(cmd)
+    local o = os.tmpname()
+    local q = "'" .. cmd:gsub("'", "'\\''") .. "'"
+    local r = os.execute(string.format("%s/test/rusage %s %s 2>/dev/null >/dev/null"
+                                      , path, o, q))
+    local f = io.open(o)
+    local t, m = f:read("*n", "*n")
+    f:close()
+    os.remove(o)
+    if r ~= 0 and r ~= true then return nil end
+    return t, m
+end
+
+-- Run a command several times and keep the best time and
+-- memory usage.
+local function best(cmd)
+    local bt, bm
+    for i = 1, runs do
+        local t, m = measure(cmd)
+        if not t then return nil end
+        bt = bt and math.min(bt, t) or t
+        bm = bm and math.min(bm, m) or m
+    end
+    return bt, bm
+end
+
+local function fsize(f)
+    local h = assert(io.open(f))
+    local s = h:seek("end")
+    h:close()
+    return s
+end
+
+-- Benchmark a development and return the table of its
+-- metrics, nil is returned if a step fails.
+function bench(d)
+    local dir = string.format("%s/test/%s", path, d.cat)
+    local out = os.tmpname()
+    local files = table.concat(d.mods, ".dk ") .. ".dk"
+    local lua = string.format("LUA_PATH=%s/lua/?.lua lua -l dedukti", path)
+    local r = { }
+
+    r.parse, r.prss = best(string.format("cd %s; %s/dkparse %s > %s", dir, path, files, out))
+    if not r.parse then return nil end
+    r.size = fsize(out)
+    local t0 = best(lua .. " -e ''")
+    local t1 = best(string.format("%s -e 'assert(loadfile(\"%s\"))'", lua, out))
+    r.check, r.crss = best(string.format("%s %s", lua, out))
+    os.remove(out)
+    if not (t0 and t1 and r.check) then return nil end
+    r.load = math.max(t1 - t0, 0)
+    r.check = math.max(r.check - t1, 0)
+    return r
+end
+
+-- Read a baseline file, each line has the form
+-- "development metric value".
+local function readbase(f)
+    local b, h = { }, io.open(f)
+    if not h then return nil end
+    for l in h:lines() do
+        local d, m, v = l:match("^(%S+)%s+(%S+)%s+(%S+)$")
+        if d then
+            b[d] = b[d] or { }
+            b[d][m] = tonumber(v)
+        end
+    end
+    h:close()
+    return b
+end
+
+local function writebase(f, res)
+    local h = assert(io.open(f, "w"))
+    for _, d in ipairs(devs) do
+        for _, m in ipairs(metrics) do
+            h:write(string.format("%s %s %s\n", d.name, m.name, res[d.name][m.name]))
+        end
+    end
+    h:close()
+end
+
+-- Parse arguments.
+for o = 1, #arg do
+    if arg[o] == "-p" and arg[o+1] then
+        path = arg[o+1]
+    elseif arg[o] == "-b" and arg[o+1] then
+        base = arg[o+1]
+    elseif arg[o] == "-n" and arg[o+1] then
+        runs = tonumber(arg[o+1])
+    elseif arg[o] == "-s" and arg[o+1] then
+        scale = tonumber(arg[o+1])
+    elseif arg[o] == "-w" then
+        write = true
+    elseif arg[o] == "-h" then
+        print("usage: corpus.lua [-p PATH] [-b FILE] [-n RUNS] [-s SCALE] [-w] [-h]")
+        print("\t-p\tSet the root path of the project.")
+        print("\t-b\tSet the baseline file (default test/corpus.base).")
+        print("\t-n\tNumber of runs, the best one is kept (default 3).")
+        print("\t-s\tScale regression tolerances by this factor.")
+        print("\t-w\tWrite the baseline file instead of comparing.")
+        print("\t-h\tDisplay this help message.")
+        return
+    end
+end
+base = base or path .. "/test/corpus.base"
+
+-- Run benchmarks.
+local res, failed, b = { }, 0, readbase(base)
+if not write and not b then
+    print(red("No baseline found in " .. base .. ", use -w to create one."))
+    os.exit(1)
+end
+for _, d in ipairs(devs) do
+    print("\t-- Benchmarking development " .. d.name .. " --")
+    local r = bench(d)
+    if not r then
+        print(red("Benchmark failed."))
+        os.exit(1)
+    end
+    res[d.name] = r
+    for _, m in ipairs(metrics) do
+        local v, s = r[m.name], ""
+        local o = b and b[d.name] and b[d.name][m.name]
+        if not write and o then
+            local lim = o * (1 + m.tol * scale) + m.slack
+            s = string.format("(base %g, %+.1f%%) ", o, o > 0 and (v - o) / o * 100 or 0)
+            if v > lim then
+                s = s .. red("regressed")
+                failed = failed + 1
+            else
+                s = s .. green("ok")
+            end
+        end
+        print(string.format("%8s %12.4g %-2s %s", m.name, v, m.unit, s))
+    end
+    print("")
+end
+
+if write then
+    writebase(base, res)
+    print("Baseline written to " .. base .. ".")
+elseif failed ~= 0 then
+    print(string.format("\n%s metric(s) regressed!", red(failed)))
+    os.exit(1)
+else
+    print("\nNo regression.")
+end
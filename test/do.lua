@@ -6,11 +6,44 @@ do
         { name = "bug_abs", result = nil },
         { name = "exemple", result = true },
         { name = "peano", result = true, deps = { "coc", "logic" } },
+        { name = "peano", result = true, deps = { "coc", "logic" }, opts = "-p" },
         { name = "f", result = true },
         -- { name = "compute", result = true },
         { name = "dotpat", result = true},
         { name = "qualpat", result = true },
         { name = "scope", result = true },
+        { name = "peano", result = true, deps = { "coc", "logic" }, opts = "-n" },
+        { name = "compute", result = true, opts = "-n" },
+        { name = "peano", result = true, deps = { "coc", "logic" }, opts = "-t" },
+        { name = "peano", result = true, deps = { "coc", "logic" }, opts = "-j 3" },
+        { name = "dotpat", result = true, opts = "-j 2" },
+        { name = "bug_sort", result = nil, jobs = 2 },
+        { name = "peano", result = true, deps = { "coc", "logic" }, jobs = 2 },
+        { name = "bug_sort", result = nil, opts = "-k" },
+        { name = "bug_abs", result = nil, opts = "-k" },
+        { name = "exemple", result = true, opts = "-k" },
+        { name = "peano", result = true, deps = { "coc", "logic" }, opts = "-k" },
+        { name = "compute", result = true, opts = "-k" },
+        { name = "dotpat", result = true, opts = "-k" },
+        { name = "qualpat", result = true, opts = "-k" },
+        { name = "link", result = true, deps = { "coc", "logic", "peano" }, dmode = "linked" },
+        { name = "link", result = true, deps = { "coc", "logic", "peano" }, dmode = "linked", opts = "-n" },
+        { name = "peano", result = true, deps = { "coc", "logic" }, dmode = "compiled" },
+        { name = "link", result = true, deps = { "coc", "logic", "peano" }, dmode = "compiled" },
+        { name = "spill", result = true, deps = { "syms" } },
+        { name = "spill", result = true, deps = { "syms" }, dmode = "compiled" },
+        { name = "link", result = true, deps = { "coc", "logic", "peano" }, dmode = "cached" },
+        { name = "link", result = nil, deps = { "coc", "logic", "peano" }, dmode = "stale" },
+        { name = "peano", result = true, deps = { "coc", "logic" }, dmode = "stdin" },
+        { name = "peano", result = true, deps = { "coc", "logic" }, dmode = "stdin", opts = "-t" },
+        { name = "bug_sort", result = nil, dmode = "stdin" },
+        { name = "prof", result = true, opts = "-r prof.prof", expect = {
+            "function (y1, y2)\nif y1[1] == 3 and y1[2] == \"prof.S\" then",
+            "function (y1, y2)\nif y2[1] == 3 and y2[2] == \"prof.S\" then",
+        } },
+        { name = "prof", result = nil, opts = "-r badprof.prof", expect = false },
+        { name = "deep", result = true, opts = "-k" },
+        { name = "deeppat", result = true },
     }
 
     tests = { unit = unit_tests }
@@ -31,34 +64,89 @@ end
 local function green(s) return "\027[32m" .. s .. "\027[m" end
 local function   red(s) return "\027[31m" .. s .. "\027[m" end
 
-function dkcheck(cat, f, deps)
-    local function clamp(ret)
-        if _VERSION ~= "Lua 5.1" then return ret end
-        if ret ~= 0 then return nil else return true end
-    end
+local function clamp(ret)
+    if _VERSION ~= "Lua 5.1" then return ret end
+    if ret ~= 0 then return nil else return true end
+end
 
+function dkcheck(cat, f, deps, opts, jobs, dmode)
     local fpath, dpath = f .. ".dk", ""
     if deps then
         for _, d in ipairs(deps) do
             dpath = dpath .. " " .. d .. ".dk"
         end
     end
-    local luacmd = string.format("LUA_PATH=%s/lua/?.lua lua -l dedukti -", path)
-    local cmd    = string.format("%s/dkparse %s %s 2>/dev/null | %s", path, dpath, fpath, luacmd)
+    local luacmd = string.format("LUA_PATH=%s/lua/?.lua DKPROF=/dev/null lua -l dedukti -", path)
+    if jobs then
+        luacmd = string.format("LUA_PATH=%s/lua/?.lua DKPROF=/dev/null lua %s/lua/dkpar.lua -j %d -", path, path, jobs)
+    end
+    local cmd    = string.format("%s/dkparse %s %s %s 2>/dev/null | %s", path, opts or "", dpath, fpath, luacmd)
+    if opts and opts:match("%-k") then -- The native kernel checks the files itself.
+        cmd = string.format("%s/dkparse %s %s %s", path, opts, dpath, fpath)
+    end
+    local link
+    if dmode == "stdin" then -- The module checked is read from the standard input.
+        cmd = string.format("%s/dkparse %s %s -m %s - < %s 2>/dev/null | %s", path, opts or "", dpath, f, fpath, luacmd)
+    elseif dmode == "linked" then -- Dependencies are linked in a bundle loaded first.
+        link = os.tmpname()
+        luacmd = luacmd:gsub(" %-$", string.format(" -e 'dkdofile(\"%s\")' -", link))
+        cmd = string.format("%s/dkparse %s -l %s %s 2>/dev/null && %s/dkparse %s %s 2>/dev/null | %s"
+                           , path, opts or "", link, dpath, path, opts or "", fpath, luacmd)
+    elseif dmode == "compiled" or dmode == "cached" or dmode == "stale" then -- Dependencies are compiled and loaded on demand.
+        luacmd = luacmd:gsub("^LUA_PATH=(%S*)", "LUA_PATH='%1;./?.lua'")
+        local check = string.format("%s/dkparse %s %s 2>/dev/null | %s", path, opts or "", fpath, luacmd)
+        if dmode == "cached" then -- The second check loads the bytecode cached by the first one.
+            check = string.format("%s && ls%s && %s", check, (dpath:gsub("%.dk", ".luac")), check)
+        elseif dmode == "stale" then -- The dependencies are edited, their key kept, after being cached.
+            check = string.format("%s && for f in%s; do (echo 'error()'; cat $f) > $f.e && mv $f.e $f; done && %s"
+                                 , check, (dpath:gsub("%.dk", ".lua")), check)
+        end
+        cmd = string.format("(%s/dkparse -c %s 2>/dev/null && %s; r=$?; rm -f%s%s; exit $r)"
+                           , path, dpath, check, (dpath:gsub("%.dk", ".lua")), (dpath:gsub("%.dk", ".luac")))
+    end
     cmd = string.format("cd %s/test/%s; %s", path, cat, cmd)
+    local r
     if verbose then
         print("Running command: " .. cmd)
-        return clamp(os.execute(cmd))
+        r = clamp(os.execute(cmd))
     else
-        return clamp(os.execute(cmd .. " 2>/dev/null >/dev/null"))
+        r = clamp(os.execute(cmd .. " 2>/dev/null >/dev/null"))
+    end
+    if link then
+        os.remove(link)
+        os.remove(link .. ".luac")
+    end
+    return r
+end
+
+-- Check the code generated for f, when expect is false the generation
+-- must fail, otherwise the code must contain each string of expect.
+function dkexpect(cat, f, opts, expect)
+    local out = os.tmpname()
+    local cmd = string.format("cd %s/test/%s; %s/dkparse %s %s.dk > %s 2>/dev/null"
+                             , path, cat, path, opts or "", f, out)
+    local r = clamp(os.execute(cmd))
+    local h = io.open(out)
+    local code = h:read("*a")
+    h:close()
+    os.remove(out)
+    if not expect or not r then return not expect and not r end
+    for _, e in ipairs(expect) do
+        if not code:find(e, 1, true) then return false end
     end
+    return true
 end
 
 function runtest(cat, i, t)
     local o = io.output()
-    o:write(string.format("[TEST %02d] Running test %s... ", i, t.name))
+    local name = t.opts and t.name .. " (" .. t.opts .. ")" or t.name
+    if t.jobs then name = name .. " (" .. t.jobs .. " jobs)" end
+    if t.dmode then name = name .. " (" .. t.dmode .. ")" end
+    o:write(string.format("[TEST %02d] Running test %s... ", i, name))
     o:flush()
-    if dkcheck(cat, t.name, t.deps) == t.result then
+    if (t.expect == nil or dkexpect(cat, t.name, t.opts, t.expect))
+    and (t.expect == false -- Nothing is generated, hence nothing to check.
+         or dkcheck(cat, t.name, t.deps, t.opts, t.jobs, t.dmode) == t.result) then
         o:write(green("ok\n"))
     else
         o:write(red("failed\n"))
@@ -0,0 +1,60 @@
+/* rusage - Run a shell command and report its CPU time, user
+ * and system, (in seconds) and its peak resident set size (in
+ * kilobytes). This is used by the benchmark scripts, CPU time
+ * is much less sensitive than wall clock time to the load of
+ * the machine.
+ *
+ *     usage: rusage FILE COMMAND
+ *
+ * The two measures are written on one line in FILE, the
+ * exit status of the command is returned.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static double
+secs(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct rusage ru;
+	double t;
+	FILE *f;
+	pid_t p;
+	int st;
+
+	if (argc!=3) {
+		fprintf(stderr, "usage: %s FILE COMMAND\n", argv[0]);
+		exit(1);
+	}
+	if ((p=fork())<0) {
+		perror("fork");
+		exit(1);
+	}
+	if (p==0) {
+		execl("/bin/sh", "sh", "-c", argv[2], (char *)0);
+		perror("exec");
+		_exit(127);
+	}
+	if (waitpid(p, &st, 0)<0) {
+		perror("waitpid");
+		exit(1);
+	}
+	getrusage(RUSAGE_CHILDREN, &ru);
+	t=secs(ru.ru_utime)+secs(ru.ru_stime);
+	if (!(f=fopen(argv[1], "w"))) {
+		fprintf(stderr, "Cannot open %s.\n", argv[1]);
+		exit(1);
+	}
+	fprintf(f, "%f %ld\n", t, ru.ru_maxrss);
+	fclose(f);
+	exit(WIFEXITED(st)?WEXITSTATUS(st):1);
+}